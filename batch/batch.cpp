@@ -0,0 +1,200 @@
+#include <glob.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include "batch.h"
+#include "../bmp/mapped_file.h"
+#include "../exceptions/exceptions.h"
+#include "../parallel/bounded_queue.h"
+#include "../parallel/io_thread.h"
+#include "../parallel/thread_pool.h"
+#include "../profile/profiler.h"
+
+const std::string BMP_EXTENSION = ".bmp";
+// Finished jobs whose files wait for the writing thread before the jobs stop to wait for it.
+const size_t BATCH_WRITE_BEHIND = 2;
+// Smallest page size, so touching one byte this far apart reads every page of a mapping.
+const size_t PREFETCH_STRIDE = 4096;
+
+std::vector<std::string> ListInputs(const std::string &input) {
+    std::vector<std::string> res;
+    if (std::filesystem::is_directory(input)) {
+        for (const auto &entry : std::filesystem::directory_iterator(input)) {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+            if (entry.is_regular_file() && extension == BMP_EXTENSION) {
+                res.push_back(entry.path().string());
+            }
+        }
+    } else if (input.find_first_of("*?[") != std::string::npos) {
+        glob_t matches;
+        if (glob(input.c_str(), 0, nullptr, &matches) == 0) {
+            res.assign(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+        }
+        globfree(&matches);
+    } else {
+        std::ifstream manifest(input);
+        if (!manifest.is_open()) {
+            throw OptionExceptions(INVALID_INPUT_FILE);
+        }
+        std::string line;
+        while (std::getline(manifest, line)) {
+            if (!line.empty()) {
+                res.push_back(line);
+            }
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+std::vector<BatchJob> ListBatchJobs(const std::string &input, const std::string &output_dir) {
+    std::error_code error;
+    std::filesystem::create_directories(output_dir, error);
+    if (!std::filesystem::is_directory(output_dir)) {
+        throw OptionExceptions(INVALID_OUTPUT_FILE);
+    }
+    std::vector<BatchJob> res;
+    for (const auto &path : ListInputs(input)) {
+        res.push_back({path, (std::filesystem::path(output_dir) / std::filesystem::path(path).filename()).string()});
+    }
+    return res;
+}
+
+MemoryStream::Buffer::Buffer(const uint8_t *data, size_t size) {
+    // The get area is never written to, so dropping const is safe.
+    auto *begin = reinterpret_cast<char *>(const_cast<uint8_t *>(data));
+    setg(begin, begin, begin + size);
+}
+
+MemoryStream::Buffer::pos_type MemoryStream::Buffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                             std::ios_base::openmode which) {
+    if (!(which & std::ios_base::in)) {
+        return pos_type(off_type(-1));
+    }
+    char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+    if (off < eback() - base || off > egptr() - base) {
+        return pos_type(off_type(-1));
+    }
+    setg(eback(), base + off, egptr());
+    return pos_type(gptr() - eback());
+}
+
+MemoryStream::Buffer::pos_type MemoryStream::Buffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+MemoryStream::MemoryStream(const uint8_t *data, size_t size) : std::istream(nullptr), buffer_(data, size) {
+    rdbuf(&buffer_);
+}
+
+BatchInput ReadFile(const std::string &path) {
+    ProfileScope scope("prefetch", "io");
+    BatchInput res;
+    // Anything but a regular file is left to the job, which reports it as a file it could not decode.
+    if (!std::filesystem::is_regular_file(path)) {
+        return res;
+    }
+    res.file = MappedFile::OpenRead(path);
+    // Touching a byte of every page makes the reading thread wait for the disk instead of the job.
+    const volatile uint8_t *data = res.file->Data();
+    uint8_t sum = 0;
+    for (size_t i = 0; i < res.file->Size(); i += PREFETCH_STRIDE) {
+        sum += data[i];
+    }
+    static_cast<void>(sum);
+    scope.SetBytes(res.file->Size());
+    return res;
+}
+
+struct ReadJob {
+    size_t index;
+    BatchInput input;
+    std::exception_ptr error;
+};
+
+struct WriteJob {
+    size_t index;
+    BatchOutputs outputs;
+};
+
+size_t RunBatch(const std::vector<BatchJob> &jobs, size_t max_in_flight, bool read_ahead,
+                const std::function<void(const BatchJob &, const BatchInput &input, BatchOutputs &outputs)> &process) {
+    std::atomic<size_t> failed = 0;
+    std::mutex log_mutex;
+    auto fail = [&](size_t i, const std::exception &e, const BatchOutputs &files) {
+        ++failed;
+        std::error_code error;
+        std::filesystem::remove(jobs[i].output, error);
+        for (const auto &file : files) {
+            std::filesystem::remove(file.path, error);
+        }
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr << "Error: " << jobs[i].input << ": " << e.what() << std::endl;
+    };
+
+    BoundedQueue<ReadJob> inputs(BATCH_READ_AHEAD);
+    BoundedQueue<WriteJob> outputs(BATCH_WRITE_BEHIND);
+    IoThread reader([&] {
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            ReadJob job = {i, {}, nullptr};
+            if (read_ahead) {
+                try {
+                    job.input = ReadFile(jobs[i].input);
+                } catch (...) {
+                    job.error = std::current_exception();
+                }
+            }
+            if (!inputs.Push(std::move(job))) {
+                break;
+            }
+        }
+        inputs.Close();
+    });
+    IoThread writer([&] {
+        while (std::optional<WriteJob> job = outputs.Pop()) {
+            try {
+                for (const auto &file : job->outputs) {
+                    file.write();
+                }
+            } catch (const std::exception &e) {
+                fail(job->index, e, job->outputs);
+            }
+        }
+    });
+
+    // Every slot is one task of the pool that takes jobs until none are left, so no more than
+    // max_in_flight images are decoded at once.
+    size_t slots = std::clamp<size_t>(max_in_flight, 1, std::max<size_t>(jobs.size(), 1));
+    try {
+        ParallelFor(
+            0, slots,
+            [&](size_t, size_t) {
+                while (std::optional<ReadJob> job = inputs.Pop()) {
+                    BatchOutputs files;
+                    try {
+                        if (job->error) {
+                            std::rethrow_exception(job->error);
+                        }
+                        process(jobs[job->index], job->input, files);
+                    } catch (const std::exception &e) {
+                        fail(job->index, e, files);
+                        continue;
+                    }
+                    outputs.Push({job->index, std::move(files)});
+                }
+            },
+            1);
+    } catch (...) {
+        inputs.Close();
+        outputs.Close();
+        throw;
+    }
+    outputs.Close();
+    writer.Join();
+    reader.Join();
+    return failed;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "../bmp/mapped_file.h"
+
+// Input files read ahead of the jobs by RunBatch.
+const size_t BATCH_READ_AHEAD = 2;
+
+struct BatchJob {
+    std::string input;
+    std::string output;
+};
+
+// Input is a directory (every .bmp file in it), a glob pattern, or a manifest with one input path per
+// line. Every output goes to output_dir under the input's file name; output_dir is created if needed.
+std::vector<BatchJob> ListBatchJobs(const std::string &input, const std::string &output_dir);
+
+// Input file mapped into memory and read from the disk ahead of its job; file is null when the job reads
+// the input itself.
+struct BatchInput {
+    std::shared_ptr<MappedFile> file;
+};
+
+// Stream over bytes in memory that reads them in place, where std::istringstream would copy them first.
+class MemoryStream : public std::istream {
+public:
+    MemoryStream(const uint8_t *data, size_t size);
+
+private:
+    class Buffer : public std::streambuf {
+    public:
+        Buffer(const uint8_t *data, size_t size);
+
+    protected:
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+    };
+
+    Buffer buffer_;
+};
+
+// Write of an output file of a job, which RunBatch runs once the job is done.
+struct BatchOutput {
+    std::string path;
+    std::function<void()> write;
+};
+
+// RunBatch runs the writes in order. When the job or one of its writes fails, all of its paths are removed.
+using BatchOutputs = std::vector<BatchOutput>;
+
+// Runs process for every job with at most max_in_flight jobs at a time. A failed job is reported to
+// stderr and does not stop the others; returns the number of failed jobs.
+// The I/O runs on threads of its own, overlapping the jobs: one reads the inputs of the next jobs, at
+// most BATCH_READ_AHEAD files ahead (only when read_ahead is set), and the other runs the writes process
+// puts into its outputs, so the job takes the next input without waiting for its files to be written.
+size_t RunBatch(const std::vector<BatchJob> &jobs, size_t max_in_flight, bool read_ahead,
+                const std::function<void(const BatchJob &, const BatchInput &input, BatchOutputs &outputs)> &process);
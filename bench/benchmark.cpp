@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../bmp/bmp.h"
+#include "../convolution/convolution.h"
+#include "../filters/filters.h"
+
+// Measures the I/O paths and every filter on synthetic images and reports throughput in megapixels
+// per second. Results can be saved as a baseline and compared against on a later run:
+//
+//   image_processor_bench [--sizes 256x256,1024x768] [--filter NAME] [--min-time SECONDS]
+//                         [--out FILE] [--baseline FILE] [--tolerance FRACTION]
+//
+// The baseline file has one "<case> <width>x<height> <seconds per run> <MP/s>" line per measurement.
+
+const std::string DEFAULT_SIZES = "256x256,1024x768,3000x2000";
+const double DEFAULT_MIN_TIME = 0.2;
+const double DEFAULT_TOLERANCE = 0.1;
+const size_t MIN_RUNS = 3;
+const double MEGA = 1e6;
+const uint16_t BMP_TYPE = 0x4D42;
+const uint32_t BMP_INFO_SIZE = 40;
+const uint16_t BMP_BIT_COUNT = 24;
+// Pseudo-random noise over smooth gradients, so convolutions and thresholds see realistic data.
+const uint32_t NOISE_MULTIPLIER = 1664525;
+const uint32_t NOISE_INCREMENT = 1013904223;
+const uint32_t NOISE_SHIFT = 27;
+
+struct Size {
+    size_t width;
+    size_t height;
+};
+
+struct Options {
+    std::vector<Size> sizes;
+    std::string filter;
+    double min_time = DEFAULT_MIN_TIME;
+    std::string out;
+    std::string baseline;
+    double tolerance = DEFAULT_TOLERANCE;
+};
+
+struct Result {
+    std::string name;
+    Size size;
+    double seconds;
+    double mp_per_second;
+};
+
+std::string SizeName(const Size &size) {
+    return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+std::vector<Size> ParseSizes(const std::string &list) {
+    std::vector<Size> sizes;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t x = item.find('x');
+        if (x == std::string::npos) {
+            throw std::invalid_argument("bad size " + item);
+        }
+        sizes.push_back({std::stoul(item.substr(0, x)), std::stoul(item.substr(x + 1))});
+    }
+    return sizes;
+}
+
+Options ParseArgs(int argc, char **argv) {
+    Options options;
+    std::string sizes = DEFAULT_SIZES;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("missing value for " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--sizes") {
+            sizes = value;
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--min-time") {
+            options.min_time = std::stod(value);
+        } else if (arg == "--out") {
+            options.out = value;
+        } else if (arg == "--baseline") {
+            options.baseline = value;
+        } else if (arg == "--tolerance") {
+            options.tolerance = std::stod(value);
+        } else {
+            throw std::invalid_argument("unknown option " + arg);
+        }
+    }
+    options.sizes = ParseSizes(sizes);
+    return options;
+}
+
+BMP MakeImage(const Size &size) {
+    BMP bmp;
+    bmp.bmp_fh = {BMP_TYPE, 0, 0, 0, 0};
+    bmp.bmp_ih = {BMP_INFO_SIZE, 0, 0, 1, BMP_BIT_COUNT, 0, 0, 0, 0, 0, 0};
+    bmp.image = Image(size.width, size.height, PixelFormat::BGR8);
+    uint32_t state = 1;
+    for (size_t i = 0; i < size.height; ++i) {
+        Pixel8 *row = bmp.image.Row<Pixel8>(i);
+        for (size_t j = 0; j < size.width; ++j) {
+            state = state * NOISE_MULTIPLIER + NOISE_INCREMENT;
+            uint8_t noise = static_cast<uint8_t>(state >> NOISE_SHIFT);
+            row[j] = {static_cast<uint8_t>(j * UINT8_MAX / size.width + noise),
+                      static_cast<uint8_t>(i * UINT8_MAX / size.height + noise),
+                      static_cast<uint8_t>((i + j) % (UINT8_MAX + 1))};
+        }
+    }
+    return bmp;
+}
+
+// Runs setup and then the timed body until both MIN_RUNS runs and min_time seconds are reached;
+// reports the median time of the body.
+double Measure(double min_time, const std::function<void()> &setup, const std::function<void()> &body) {
+    std::vector<double> times;
+    double total = 0;
+    while (times.size() < MIN_RUNS || total < min_time) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        times.push_back(elapsed.count());
+        total += elapsed.count();
+    }
+    std::nth_element(times.begin(), times.begin() + static_cast<ptrdiff_t>(times.size() / 2), times.end());
+    return times[times.size() / 2];
+}
+
+template <typename T>
+std::unique_ptr<Filter> MakeFilter(const std::vector<std::string> &args) {
+    auto filter = std::make_unique<T>(args.size());
+    filter->args = args;
+    return filter;
+}
+
+// For filters that compile their arguments while parsing.
+std::unique_ptr<Filter> ParseFilter(std::unique_ptr<Filter> filter, std::vector<std::string> args) {
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(arg.data());
+    }
+    filter->Parse(argv.size(), argv.data(), 0);
+    return filter;
+}
+
+struct FilterCase {
+    std::string name;
+    std::unique_ptr<Filter> filter;
+};
+
+std::vector<FilterCase> FilterCases(const Size &size) {
+    std::vector<FilterCase> cases;
+    cases.push_back({"crop", MakeFilter<Crop>({std::to_string(size.width / 2), std::to_string(size.height / 2)})});
+    cases.push_back({"gs", MakeFilter<GrayScale>({})});
+    cases.push_back({"neg", MakeFilter<Negative>({})});
+    cases.push_back({"sharp", MakeFilter<Sharpening>({})});
+    cases.push_back({"edge", MakeFilter<EdgeDetection>({"0.1"})});
+    cases.push_back({"blur_3", MakeFilter<GaussianBlur>({"3"})});
+    cases.push_back({"blur_25", MakeFilter<GaussianBlur>({"25"})});
+    cases.push_back({"anaglyph", MakeFilter<Anaglyph>({"0.05"})});
+    cases.push_back({"conv_5x5", MakeFilter<Convolution>({"1,2,3,2,1,2,-4,-6,-4,2,3,-6,9,-6,3,2,-4,-6,-4,2,1,2,3,2,1"})});
+    auto resized = [&](size_t num, size_t den) {
+        return MakeFilter<Resize>({std::to_string(size.width * num / den), std::to_string(size.height * num / den)});
+    };
+    cases.push_back({"resize_quarter", resized(1, 4)});
+    cases.push_back({"resize_up", resized(3, 2)});
+    const std::string luma = "0.299*r + 0.587*g + 0.114*b";
+    cases.push_back({"expr_gs", ParseFilter(std::make_unique<Expression>(3), {luma, luma, luma})});
+    return cases;
+}
+
+std::vector<Result> RunBenchmarks(const Options &options) {
+    std::vector<Result> results;
+    for (const Size &size : options.sizes) {
+        BMP source = MakeImage(size);
+        std::ostringstream encoded;
+        source.WriteBMP(encoded);
+        std::string file = encoded.str();
+        BMP bmp;
+        auto run = [&](const std::string &name, const std::function<void()> &setup, const std::function<void()> &body) {
+            if (name.find(options.filter) == std::string::npos) {
+                return;
+            }
+            double seconds = Measure(options.min_time, setup, body);
+            double megapixels = static_cast<double>(size.width * size.height) / MEGA;
+            results.push_back({name, size, seconds, megapixels / seconds});
+            const Result &res = results.back();
+            std::cout << std::left << std::setw(20) << res.name << std::setw(12) << SizeName(size) << std::right
+                      << std::fixed << std::setprecision(3) << std::setw(10) << res.seconds * 1e3 << " ms"
+                      << std::setw(12) << res.mp_per_second << " MP/s" << std::endl;
+        };
+        auto load = [&](PixelFormat format) {
+            return [&, format] {
+                bmp.bmp_fh = source.bmp_fh;
+                bmp.bmp_ih = source.bmp_ih;
+                bmp.image = source.image.Clone();
+                bmp.image.ConvertTo(format);
+            };
+        };
+
+        std::istringstream input(file);
+        run("read_f32", [&] { input.seekg(0); }, [&] { bmp.ReadBMP(input); });
+        run("read_u8", [&] { input.seekg(0); }, [&] { bmp.ReadBMP(input, PixelFormat::BGR8); });
+        std::ostringstream output;
+        run("write_f32", [&] { load(PixelFormat::RGBF32)(); output.str(std::string()); }, [&] { bmp.WriteBMP(output); });
+        run("write_u8", [&] { load(PixelFormat::BGR8)(); output.str(std::string()); }, [&] { bmp.WriteBMP(output); });
+        Matrix sharp = SHARPENING_KERNEL.ToMatrix();
+        run("matrix_sharp", load(PixelFormat::RGBF32), [&] { ApplyMatrixForBMP(bmp, sharp); });
+        Matrix box(5, 5);
+        for (size_t i = 0; i < box.n; ++i) {
+            for (size_t j = 0; j < box.m; ++j) {
+                box[i][j] = 1.0 / static_cast<double>(box.n * box.m);
+            }
+        }
+        run("matrix_box_5x5", load(PixelFormat::RGBF32), [&] { ApplyMatrixForBMP(bmp, box); });
+        for (auto &[name, filter] : FilterCases(size)) {
+            run(name + "_f32", load(PixelFormat::RGBF32), [&, f = filter.get()] { f->Apply(bmp); });
+            if (filter->Supports8Bit()) {
+                run(name + "_u8", load(PixelFormat::BGR8), [&, f = filter.get()] { f->Apply(bmp); });
+            }
+        }
+    }
+    return results;
+}
+
+void WriteResults(const std::string &path, const std::vector<Result> &results) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("cannot write " + path);
+    }
+    out << std::setprecision(9);
+    for (const Result &res : results) {
+        out << res.name << ' ' << SizeName(res.size) << ' ' << res.seconds << ' ' << res.mp_per_second << '\n';
+    }
+}
+
+// Prints the speed of every case relative to the baseline; returns the number of cases that got
+// slower by more than tolerance.
+size_t CompareResults(const std::string &path, const std::vector<Result> &results, double tolerance) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        throw std::runtime_error("cannot read " + path);
+    }
+    std::map<std::string, double> baseline;
+    std::string name;
+    std::string size;
+    double seconds = 0;
+    double mp_per_second = 0;
+    while (in >> name >> size >> seconds >> mp_per_second) {
+        baseline[name + ' ' + size] = mp_per_second;
+    }
+    size_t regressions = 0;
+    std::cout << "\nrelative to " << path << ":\n";
+    for (const Result &res : results) {
+        auto it = baseline.find(res.name + ' ' + SizeName(res.size));
+        if (it == baseline.end()) {
+            continue;
+        }
+        double ratio = res.mp_per_second / it->second;
+        bool slower = ratio < 1 - tolerance;
+        regressions += slower;
+        std::cout << std::left << std::setw(20) << res.name << std::setw(12) << SizeName(res.size) << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(8) << ratio << "x"
+                  << (slower ? "  SLOWER" : "") << '\n';
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    try {
+        Options options = ParseArgs(argc, argv);
+        std::vector<Result> results = RunBenchmarks(options);
+        if (!options.out.empty()) {
+            WriteResults(options.out, results);
+        }
+        if (!options.baseline.empty() && CompareResults(options.baseline, results, options.tolerance) > 0) {
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,15 +1,53 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
 #include "bmp.h"
 #include "../exceptions/exceptions.h"
+#include "../convolution/convolution.h"
 
 const uint16_t BMP_FORMAT = 0x4D42;
-const uint32_t BMP_BI_NEED_SIZE = 40;
+const uint32_t BMP_FILE_HEADER_SIZE = 14;
+const uint32_t BMP_INFO_HEADER_SIZE = 40;
+const uint32_t BMP_V2_HEADER_SIZE = 52;
+const uint32_t BMP_V3_HEADER_SIZE = 56;
+const uint32_t BMP_V4_HEADER_SIZE = 108;
+const uint32_t BMP_V5_HEADER_SIZE = 124;
 const uint16_t BMP_BI_BIT_COUNT = 24;
-const uint16_t BMP_BI_COMPRESSION = 0;
+const uint16_t BMP_BI_BIT_COUNT_32 = 32;
+const uint16_t BMP_BI_BIT_COUNT_8 = 8;
+const uint16_t BMP_BI_BIT_COUNT_4 = 4;
+const uint32_t BMP_BI_RGB = 0;
+const uint32_t BMP_BI_RLE8 = 1;
+const uint32_t BMP_BI_RLE4 = 2;
+const uint32_t BMP_BI_BITFIELDS = 3;
+const uint32_t BMP_BI_ALPHABITFIELDS = 6;
+const uint32_t BMP_RED_MASK = 0x00FF0000;
+const uint32_t BMP_GREEN_MASK = 0x0000FF00;
+const uint32_t BMP_BLUE_MASK = 0x000000FF;
+const uint32_t BMP_ALPHA_MASK = 0xFF000000;
+// LCS_sRGB color space of V4 headers.
+const uint32_t BMP_SRGB = 0x73524742;
+// CIEXYZTRIPLE endpoints and three gamma values, unused for sRGB.
+const size_t BMP_V4_UNUSED_SIZE = 48;
+const size_t PALETTE_SIZE = 256;
+const size_t PALETTE_ENTRY_SIZE = 4;
+// RLE data is made of two-byte commands: a run of count pixels, or an escape (count 0) followed by one of
+// the codes below or, for larger values, by that many literal pixels padded to a whole word.
+const uint8_t RLE_ESCAPE = 0;
+const uint8_t RLE_END_OF_LINE = 0;
+const uint8_t RLE_END_OF_BITMAP = 1;
+const uint8_t RLE_DELTA = 2;
+const size_t RLE_MIN_LITERAL = 3;
+const size_t RLE_MAX_RUN = 255;
+const uint8_t NIBBLE = 4;
+const uint8_t NIBBLE_MASK = 0x0F;
 const uint32_t BYTE = 3;
 const uint32_t ALLIGN = 4;
-const double MAX_COLOR = std::numeric_limits<uint8_t>::max();
+const size_t IO_BLOCK_SIZE = 1 << 20;
 
-void BitMapFileHeader::ReadBitMapFileHeader(std::ifstream &f) {
+void BitMapFileHeader::ReadBitMapFileHeader(std::istream &f) {
     Read(f, bf_type, sizeof(bf_type));
     if (bf_type != BMP_FORMAT) {
         throw BMPExceptions(FILE_FORMAT);
@@ -20,7 +58,7 @@ void BitMapFileHeader::ReadBitMapFileHeader(std::ifstream &f) {
     Read(f, bf_offset, sizeof(bf_offset));
 }
 
-void BitMapFileHeader::WriteBitMapFileHeader(std::ofstream &f) {
+void BitMapFileHeader::WriteBitMapFileHeader(std::ostream &f) {
     Write(f, bf_type, sizeof(bf_type));
     Write(f, bf_size, sizeof(bf_size));
     Write(f, bf_reversed1, sizeof(bf_reversed1));
@@ -28,20 +66,25 @@ void BitMapFileHeader::WriteBitMapFileHeader(std::ofstream &f) {
     Write(f, bf_offset, sizeof(bf_offset));
 }
 
-void BitMapInfoHeader::ReadBitMapInfoHeader(std::ifstream &f) {
+void BitMapInfoHeader::ReadBitMapInfoHeader(std::istream &f) {
     Read(f, bi_size, sizeof(bi_size));
-    if (bi_size != BMP_BI_NEED_SIZE) {
+    if (bi_size != BMP_INFO_HEADER_SIZE && bi_size != BMP_V2_HEADER_SIZE && bi_size != BMP_V3_HEADER_SIZE &&
+        bi_size != BMP_V4_HEADER_SIZE && bi_size != BMP_V5_HEADER_SIZE) {
         throw BMPExceptions(HEADER_NAME);
     }
     Read(f, bi_width, sizeof(bi_width));
     Read(f, bi_height, sizeof(bi_height));
     Read(f, bi_planes, sizeof(bi_planes));
     Read(f, bi_bit_count, sizeof(bi_bit_count));
-    if (this->bi_bit_count != BMP_BI_BIT_COUNT) {
+    if (bi_bit_count != BMP_BI_BIT_COUNT && bi_bit_count != BMP_BI_BIT_COUNT_32 &&
+        bi_bit_count != BMP_BI_BIT_COUNT_8 && bi_bit_count != BMP_BI_BIT_COUNT_4) {
         throw BMPExceptions(BIT_COUNT);
     }
     Read(f, bi_compression, sizeof(bi_compression));
-    if (bi_compression != BMP_BI_COMPRESSION) {
+    bool bitfields = bi_compression == BMP_BI_BITFIELDS || bi_compression == BMP_BI_ALPHABITFIELDS;
+    bool rle = (bi_compression == BMP_BI_RLE8 && bi_bit_count == BMP_BI_BIT_COUNT_8) ||
+               (bi_compression == BMP_BI_RLE4 && bi_bit_count == BMP_BI_BIT_COUNT_4);
+    if (bi_compression != BMP_BI_RGB && !rle && !(bitfields && bi_bit_count == BMP_BI_BIT_COUNT_32)) {
         throw BMPExceptions(COMPRESSION);
     }
     Read(f, bi_image_size, sizeof(bi_image_size));
@@ -49,9 +92,32 @@ void BitMapInfoHeader::ReadBitMapInfoHeader(std::ifstream &f) {
     Read(f, bi_vert_ppm, sizeof(bi_vert_ppm));
     Read(f, bi_colors_used, sizeof(bi_colors_used));
     Read(f, bi_colors_important, sizeof(bi_colors_important));
+    // Newer headers hold the masks themselves, the plain info header is followed by them.
+    size_t masks = 0;
+    if (bi_size >= BMP_V3_HEADER_SIZE || bi_compression == BMP_BI_ALPHABITFIELDS) {
+        masks = 4;
+    } else if (bi_size == BMP_V2_HEADER_SIZE || bi_compression == BMP_BI_BITFIELDS) {
+        masks = 3;
+    }
+    uint32_t *mask_fields[] = {&bi_red_mask, &bi_green_mask, &bi_blue_mask, &bi_alpha_mask};
+    for (size_t k = 0; k < 4; ++k) {
+        *mask_fields[k] = 0;
+        if (k < masks) {
+            Read(f, *mask_fields[k], sizeof(uint32_t));
+        }
+    }
+    if (bi_size > BMP_INFO_HEADER_SIZE) {
+        f.ignore(static_cast<std::streamsize>(bi_size - BMP_INFO_HEADER_SIZE - masks * sizeof(uint32_t)));
+    }
+    if (!bitfields) {
+        bi_red_mask = BMP_RED_MASK;
+        bi_green_mask = BMP_GREEN_MASK;
+        bi_blue_mask = BMP_BLUE_MASK;
+        bi_alpha_mask = 0;
+    }
 }
 
-void BitMapInfoHeader::WriteBitMapInfoHeader(std::ofstream &f) {
+void BitMapInfoHeader::WriteBitMapInfoHeader(std::ostream &f) {
     Write(f, bi_size, sizeof(bi_size));
     Write(f, bi_width, sizeof(bi_width));
     Write(f, bi_height, sizeof(bi_height));
@@ -63,49 +129,570 @@ void BitMapInfoHeader::WriteBitMapInfoHeader(std::ofstream &f) {
     Write(f, bi_vert_ppm, sizeof(bi_vert_ppm));
     Write(f, bi_colors_used, sizeof(bi_colors_used));
     Write(f, bi_colors_important, sizeof(bi_colors_important));
+    if (bi_size == BMP_V4_HEADER_SIZE) {
+        Write(f, bi_red_mask, sizeof(bi_red_mask));
+        Write(f, bi_green_mask, sizeof(bi_green_mask));
+        Write(f, bi_blue_mask, sizeof(bi_blue_mask));
+        Write(f, bi_alpha_mask, sizeof(bi_alpha_mask));
+        uint32_t color_space = BMP_SRGB;
+        Write(f, color_space, sizeof(color_space));
+        std::array<char, BMP_V4_UNUSED_SIZE> unused = {};
+        Write(f, unused, sizeof(unused));
+    }
+}
+
+uint32_t RowSize(uint32_t width, uint16_t bit_count) {
+    uint32_t row_size = (width * bit_count + (1 << BYTE) - 1) >> BYTE;
+    return row_size + (ALLIGN - row_size % ALLIGN) % ALLIGN;
+}
+
+size_t RowsPerBlock(uint32_t row_size) {
+    return std::max<size_t>(1, IO_BLOCK_SIZE / std::max<uint32_t>(row_size, 1));
+}
+
+// One channel of a BI_BITFIELDS pixel, scaled to 0..255.
+class MaskedChannel {
+public:
+    explicit MaskedChannel(uint32_t mask)
+        : mask_(mask), shift_(mask == 0 ? 0 : std::countr_zero(mask)), max_(mask >> shift_) {
+    }
+
+    uint8_t Get(uint32_t pixel) const {
+        if (max_ == 0) {
+            return 0;
+        }
+        uint64_t value = (pixel & mask_) >> shift_;
+        return static_cast<uint8_t>((value * UINT8_MAX + max_ / 2) / max_);
+    }
+
+private:
+    uint32_t mask_;
+    uint32_t shift_;
+    uint64_t max_;
+};
+
+void Decode32Row(const uint8_t *src, Pixel8 *dst, uint8_t *alpha, size_t width, const BitMapInfoHeader &header) {
+    if (header.bi_red_mask == BMP_RED_MASK && header.bi_green_mask == BMP_GREEN_MASK &&
+        header.bi_blue_mask == BMP_BLUE_MASK) {
+        for (size_t j = 0; j < width; ++j) {
+            dst[j] = {src[j * 4], src[j * 4 + 1], src[j * 4 + 2]};
+        }
+        if (alpha != nullptr && header.bi_alpha_mask == BMP_ALPHA_MASK) {
+            for (size_t j = 0; j < width; ++j) {
+                alpha[j] = src[j * 4 + 3];
+            }
+            return;
+        }
+    } else {
+        MaskedChannel red(header.bi_red_mask);
+        MaskedChannel green(header.bi_green_mask);
+        MaskedChannel blue(header.bi_blue_mask);
+        for (size_t j = 0; j < width; ++j) {
+            uint32_t pixel = 0;
+            std::memcpy(&pixel, src + j * 4, sizeof(pixel));
+            dst[j] = {blue.Get(pixel), green.Get(pixel), red.Get(pixel)};
+        }
+    }
+    if (alpha != nullptr) {
+        MaskedChannel channel(header.bi_alpha_mask);
+        for (size_t j = 0; j < width; ++j) {
+            uint32_t pixel = 0;
+            std::memcpy(&pixel, src + j * 4, sizeof(pixel));
+            alpha[j] = channel.Get(pixel);
+        }
+    }
 }
 
-uint8_t ExtractByte(uint32_t byte_id, uint32_t buffer) {
-    return (buffer >> (byte_id * (1 << BYTE))) & ((1 << (1 << BYTE)) - 1);
+void BMP::DecodeIndices(const uint8_t *indices, Image &dst, size_t i) const {
+    size_t width = dst.Width();
+    if (dst.Format() == PixelFormat::GRAY8) {
+        uint8_t *row = dst.Row<uint8_t>(i);
+        for (size_t j = 0; j < width; ++j) {
+            row[j] = palette[indices[j]].red;
+        }
+        return;
+    }
+    thread_local std::vector<Pixel8> scratch;
+    Pixel8 *pixels = dst.Row<Pixel8>(i);
+    if (dst.Format() != PixelFormat::BGR8) {
+        scratch.resize(width);
+        pixels = scratch.data();
+    }
+    for (size_t j = 0; j < width; ++j) {
+        pixels[j] = palette[indices[j]];
+    }
+    if (dst.Format() == PixelFormat::RGBF32) {
+        UnpackBGR8Row(pixels, dst.Row(i), width);
+    }
 }
 
-void BMP::ReadBMP(std::ifstream &f) {
+void BMP::DecodeRow(const uint8_t *src, Image &dst, size_t i, Image *dst_alpha) const {
+    size_t width = dst.Width();
+    if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_8) {
+        DecodeIndices(src, dst, i);
+        return;
+    }
+    if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_4) {
+        thread_local std::vector<uint8_t> indices;
+        indices.resize(width);
+        for (size_t j = 0; j < width; ++j) {
+            indices[j] = j % 2 == 0 ? src[j / 2] >> NIBBLE : src[j / 2] & NIBBLE_MASK;
+        }
+        DecodeIndices(indices.data(), dst, i);
+        return;
+    }
+    thread_local std::vector<Pixel8> scratch;
+    Pixel8 *pixels = dst.Row<Pixel8>(i);
+    if (dst.Format() != PixelFormat::BGR8) {
+        scratch.resize(width);
+        pixels = scratch.data();
+    }
+    if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_32) {
+        Decode32Row(src, pixels, dst_alpha == nullptr ? nullptr : dst_alpha->Row<uint8_t>(i), width, bmp_ih);
+    } else {
+        std::memcpy(pixels, src, width * sizeof(Pixel8));
+    }
+    if (dst.Format() == PixelFormat::RGBF32) {
+        UnpackBGR8Row(pixels, dst.Row(i), width);
+    }
+}
+
+void BMP::EncodeRow(const Image &src, size_t i, const Image *src_alpha, uint8_t *dst) const {
+    size_t width = src.Width();
+    // An empty row has no pixels to point to, not even in scratch.
+    if (width == 0) {
+        return;
+    }
+    if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_8) {
+        std::memcpy(dst, src.Row<uint8_t>(i), width);
+        return;
+    }
+    thread_local std::vector<Pixel8> scratch;
+    const Pixel8 *pixels = src.Row<Pixel8>(i);
+    if (src.Format() != PixelFormat::BGR8) {
+        scratch.resize(width);
+        if (src.Format() == PixelFormat::GRAY8) {
+            ExpandGray8Row(src.Row<uint8_t>(i), scratch.data(), width);
+        } else {
+            PackBGR8Row(src.Row(i), scratch.data(), width);
+        }
+        pixels = scratch.data();
+    }
+    if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT) {
+        std::memcpy(dst, pixels, width * sizeof(Pixel8));
+        return;
+    }
+    const uint8_t *alpha = src_alpha == nullptr ? nullptr : src_alpha->Row<uint8_t>(i);
+    for (size_t j = 0; j < width; ++j) {
+        dst[j * 4] = pixels[j].blue;
+        dst[j * 4 + 1] = pixels[j].green;
+        dst[j * 4 + 2] = pixels[j].red;
+        dst[j * 4 + 3] = alpha == nullptr ? 0 : alpha[j];
+    }
+}
+
+bool BMP::HasAlpha() const {
+    return bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_32 && bmp_ih.bi_alpha_mask != 0;
+}
+
+bool BMP::IsGray() const {
+    return bmp_ih.bi_bit_count <= BMP_BI_BIT_COUNT_8 &&
+           std::all_of(palette.begin(), palette.end(),
+                       [](const Pixel8 &p) { return p.red == p.green && p.green == p.blue; });
+}
+
+bool BMP::IsRLE() const {
+    return bmp_ih.bi_compression == BMP_BI_RLE8 || bmp_ih.bi_compression == BMP_BI_RLE4;
+}
+
+void BMP::ReadHeaders(std::istream &f) {
     bmp_fh.ReadBitMapFileHeader(f);
     bmp_ih.ReadBitMapInfoHeader(f);
-    data.resize(bmp_ih.bi_height, std::vector<Pixel>(bmp_ih.bi_width));
-    uint32_t padding = (ALLIGN - (bmp_ih.bi_width * (bmp_ih.bi_bit_count >> BYTE))) % ALLIGN;
-    for (size_t i = bmp_ih.bi_height; i--;) {
-        for (size_t j = 0; j < bmp_ih.bi_width; ++j) {
-            uint32_t buffer = 0;
-            Read(f, buffer, bmp_ih.bi_bit_count >> BYTE);
-            data[i][j].blue = static_cast<double>(ExtractByte(0, buffer)) / MAX_COLOR;
-            data[i][j].green = static_cast<double>(ExtractByte(1, buffer)) / MAX_COLOR;
-            data[i][j].red = static_cast<double>(ExtractByte(2, buffer)) / MAX_COLOR;
+    palette.clear();
+    if (bmp_ih.bi_bit_count <= BMP_BI_BIT_COUNT_8) {
+        size_t colors = size_t{1} << bmp_ih.bi_bit_count;
+        if (bmp_ih.bi_colors_used != 0) {
+            colors = std::min<size_t>(bmp_ih.bi_colors_used, PALETTE_SIZE);
+        }
+        std::vector<uint8_t> entries(colors * PALETTE_ENTRY_SIZE);
+        f.read(reinterpret_cast<char *>(entries.data()), static_cast<std::streamsize>(entries.size()));
+        if (!f) {
+            throw BMPExceptions(TRUNCATED_FILE);
+        }
+        // Indices past the stored colors are invalid; they decode as black rather than out of bounds.
+        palette.assign(PALETTE_SIZE, {0, 0, 0});
+        for (size_t k = 0; k < colors; ++k) {
+            palette[k] = {entries[k * PALETTE_ENTRY_SIZE], entries[k * PALETTE_ENTRY_SIZE + 1],
+                          entries[k * PALETTE_ENTRY_SIZE + 2]};
+        }
+    }
+}
+
+void BMP::ReadBMP(std::istream &f, PixelFormat format, size_t max_width, size_t max_height) {
+    ReadHeaders(f);
+    if (format == PixelFormat::GRAY8 && !IsGray()) {
+        format = PixelFormat::BGR8;
+    }
+    size_t width = std::min<size_t>(bmp_ih.bi_width, max_width);
+    size_t height = std::min<size_t>(bmp_ih.bi_height, max_height);
+    image = Image(width, height, format);
+    alpha = HasAlpha() ? Image(width, height, PixelFormat::GRAY8) : Image();
+    if (IsRLE()) {
+        ReadRLE(f);
+        return;
+    }
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    // Rows are stored bottom-up, so the top rows we keep are the last ones in the file.
+    f.seekg(bmp_fh.bf_offset + static_cast<std::streamoff>(row_size) * (bmp_ih.bi_height - height), std::ios_base::beg);
+    size_t rows_per_block = RowsPerBlock(row_size);
+    std::vector<char> block(rows_per_block * row_size);
+    for (size_t done = 0; done < height;) {
+        size_t rows = std::min<size_t>(rows_per_block, height - done);
+        f.read(block.data(), static_cast<std::streamsize>(rows * row_size));
+        if (!f) {
+            throw BMPExceptions(TRUNCATED_FILE);
+        }
+        for (size_t k = 0; k < rows; ++k) {
+            DecodeRow(reinterpret_cast<const uint8_t *>(block.data() + k * row_size), image, height - 1 - (done + k),
+                      HasAlpha() ? &alpha : nullptr);
+        }
+        done += rows;
+    }
+}
+
+// Runs are expanded into one row of palette indices, which is decoded into image once the row is done,
+// so the whole image is never held uncompressed twice. Pixels the data skips get index 0.
+void BMP::ReadRLE(std::istream &f) {
+    f.seekg(bmp_fh.bf_offset, std::ios_base::beg);
+    std::vector<uint8_t> data;
+    if (bmp_ih.bi_image_size != 0) {
+        data.resize(bmp_ih.bi_image_size);
+        f.read(reinterpret_cast<char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!f) {
+            throw BMPExceptions(TRUNCATED_FILE);
+        }
+    } else {
+        data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    bool rle4 = bmp_ih.bi_compression == BMP_BI_RLE4;
+    size_t width = bmp_ih.bi_width;
+    size_t height = bmp_ih.bi_height;
+    std::vector<uint8_t> row(width, 0);
+    // Rows are stored bottom-up, so y counts them from the bottom of the image.
+    size_t x = 0;
+    size_t y = 0;
+    auto next_row = [&] {
+        if (height - 1 - y < image.Height()) {
+            DecodeIndices(row.data(), image, height - 1 - y);
+        }
+        std::fill(row.begin(), row.end(), 0);
+        ++y;
+    };
+    // RLE4 runs alternate between the two nibbles of their byte.
+    auto run = [&](uint8_t first, uint8_t second, size_t count) {
+        size_t end = std::min(width, x + count);
+        if (first == second) {
+            std::fill(row.begin() + static_cast<ptrdiff_t>(std::min(x, end)), row.begin() + static_cast<ptrdiff_t>(end),
+                      first);
+        } else {
+            for (size_t j = x; j < end; ++j) {
+                row[j] = (j - x) % 2 == 0 ? first : second;
+            }
+        }
+        x += count;
+    };
+    for (size_t pos = 0; y < height && pos + 1 < data.size();) {
+        uint8_t count = data[pos];
+        uint8_t value = data[pos + 1];
+        pos += 2;
+        if (count != RLE_ESCAPE) {
+            if (rle4) {
+                run(value >> NIBBLE, value & NIBBLE_MASK, count);
+            } else {
+                run(value, value, count);
+            }
+        } else if (value == RLE_END_OF_LINE) {
+            next_row();
+            x = 0;
+        } else if (value == RLE_END_OF_BITMAP) {
+            break;
+        } else if (value == RLE_DELTA) {
+            if (pos + 1 >= data.size()) {
+                throw BMPExceptions(TRUNCATED_FILE);
+            }
+            x += data[pos];
+            for (size_t k = 0; k < data[pos + 1] && y < height; ++k) {
+                next_row();
+            }
+            pos += 2;
+        } else {
+            size_t bytes = rle4 ? (value + 1) / 2 : value;
+            if (pos + bytes > data.size()) {
+                throw BMPExceptions(TRUNCATED_FILE);
+            }
+            for (size_t k = 0; k < value; ++k, ++x) {
+                if (x < width) {
+                    row[x] = rle4 ? (k % 2 == 0 ? data[pos + k / 2] >> NIBBLE : data[pos + k / 2] & NIBBLE_MASK)
+                                  : data[pos + k];
+                }
+            }
+            pos += bytes + bytes % 2;
+        }
+    }
+    while (y < height) {
+        next_row();
+    }
+}
+
+void BMP::ReadRows(std::istream &f, size_t begin, Image &dst) const {
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    size_t rows = dst.Height();
+    std::vector<char> block(rows * row_size);
+    // Rows [begin, begin + rows) are stored bottom-up as one contiguous run of the file.
+    f.seekg(bmp_fh.bf_offset + static_cast<std::streamoff>(row_size) * (bmp_ih.bi_height - begin - rows),
+            std::ios_base::beg);
+    f.read(block.data(), static_cast<std::streamsize>(block.size()));
+    if (!f) {
+        throw BMPExceptions(TRUNCATED_FILE);
+    }
+    for (size_t k = 0; k < rows; ++k) {
+        DecodeRow(reinterpret_cast<const uint8_t *>(block.data() + k * row_size), dst, rows - 1 - k, nullptr);
+    }
+}
+
+void BMP::MapBMP(std::istream &f, const std::shared_ptr<MappedFile> &file, PixelFormat format) {
+    ReadHeaders(f);
+    if (bmp_ih.bi_bit_count != BMP_BI_BIT_COUNT) {
+        f.seekg(0, std::ios_base::beg);
+        ReadBMP(f, format);
+        return;
+    }
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    if (file->Size() < bmp_fh.bf_offset + static_cast<size_t>(row_size) * bmp_ih.bi_height) {
+        throw BMPExceptions(TRUNCATED_FILE);
+    }
+    uint8_t *last_row = file->Data() + bmp_fh.bf_offset + static_cast<size_t>(row_size) * (bmp_ih.bi_height - 1);
+    image = Image::Wrap(file, last_row, bmp_ih.bi_width, bmp_ih.bi_height, -static_cast<ptrdiff_t>(row_size),
+                        PixelFormat::BGR8);
+    alpha = Image();
+    if (format == PixelFormat::RGBF32) {
+        image.ConvertTo(format);
+    }
+}
+
+void BMP::SetLayout(uint16_t bit_count, bool has_alpha) {
+    bool v4 = bit_count == BMP_BI_BIT_COUNT_32 && has_alpha;
+    bmp_ih.bi_size = v4 ? BMP_V4_HEADER_SIZE : BMP_INFO_HEADER_SIZE;
+    bmp_ih.bi_bit_count = bit_count;
+    bmp_ih.bi_compression = v4 ? BMP_BI_BITFIELDS : BMP_BI_RGB;
+    bmp_ih.bi_red_mask = BMP_RED_MASK;
+    bmp_ih.bi_green_mask = BMP_GREEN_MASK;
+    bmp_ih.bi_blue_mask = BMP_BLUE_MASK;
+    bmp_ih.bi_alpha_mask = v4 ? BMP_ALPHA_MASK : 0;
+    palette.clear();
+    // Left from an input with a palette, it would count colors the output does not have.
+    bmp_ih.bi_colors_important = 0;
+    if (bit_count == BMP_BI_BIT_COUNT_8) {
+        for (size_t k = 0; k < PALETTE_SIZE; ++k) {
+            uint8_t level = static_cast<uint8_t>(k);
+            palette.push_back({level, level, level});
         }
-        f.seekg(padding, std::ios_base::cur);
+        bmp_ih.bi_colors_used = PALETTE_SIZE;
+    } else {
+        bmp_ih.bi_colors_used = 0;
     }
+    bmp_fh.bf_offset = BMP_FILE_HEADER_SIZE + bmp_ih.bi_size + palette.size() * PALETTE_ENTRY_SIZE;
 }
 
-double NormalizeValue(double x) {
-    return std::max(0.0, std::min(x, 1.0));
+uint32_t BMP::UpdateHeaders() {
+    uint16_t bit_count = BMP_BI_BIT_COUNT;
+    if (image.Format() == PixelFormat::GRAY8) {
+        bit_count = BMP_BI_BIT_COUNT_8;
+    } else if (bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_32) {
+        bit_count = BMP_BI_BIT_COUNT_32;
+    }
+    SetLayout(bit_count, !alpha.Empty());
+    bmp_ih.bi_width = image.Width();
+    bmp_ih.bi_height = image.Height();
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    bmp_ih.bi_image_size = row_size * bmp_ih.bi_height;
+    bmp_fh.bf_size = bmp_fh.bf_offset + bmp_ih.bi_image_size;
+    return row_size;
 }
 
-void BMP::WriteBMP(std::ofstream &f) {
-    bmp_fh.bf_size = sizeof(bmp_fh) + sizeof(bmp_ih) + BYTE * bmp_ih.bi_width * bmp_ih.bi_height;
+void BMP::WriteAllHeaders(std::ostream &f) {
     bmp_fh.WriteBitMapFileHeader(f);
     bmp_ih.WriteBitMapInfoHeader(f);
-    uint32_t padding = (ALLIGN - (bmp_ih.bi_width * (bmp_ih.bi_bit_count >> BYTE))) % ALLIGN;
-    for (size_t i = bmp_ih.bi_height; i--;) {
-        for (size_t j = 0; j < bmp_ih.bi_width; ++j) {
-            uint8_t blue = static_cast<uint8_t>(std::round(MAX_COLOR * NormalizeValue(data[i][j].blue)));
-            uint8_t green = static_cast<uint8_t>(std::round(MAX_COLOR * NormalizeValue(data[i][j].green)));
-            uint8_t red = static_cast<uint8_t>(std::round(MAX_COLOR * NormalizeValue(data[i][j].red)));
-            Write(f, blue, sizeof(blue));
-            Write(f, green, sizeof(green));
-            Write(f, red, sizeof(red));
+    for (const Pixel8 &color : palette) {
+        std::array<char, PALETTE_ENTRY_SIZE> entry = {static_cast<char>(color.blue), static_cast<char>(color.green),
+                                                      static_cast<char>(color.red), 0};
+        Write(f, entry, sizeof(entry));
+    }
+}
+
+size_t RunLength(const uint8_t *row, size_t begin, size_t width) {
+    size_t end = begin + 1;
+    while (end < width && end - begin < RLE_MAX_RUN && row[end] == row[begin]) {
+        ++end;
+    }
+    return end - begin;
+}
+
+// Runs of at least RLE_MIN_LITERAL equal pixels are stored as runs and the pixels between them literally;
+// shorter stretches cannot be literal and become runs of one.
+void EncodeRLE8Row(const uint8_t *row, size_t width, std::vector<uint8_t> &data) {
+    for (size_t j = 0; j < width;) {
+        size_t length = RunLength(row, j, width);
+        if (length >= RLE_MIN_LITERAL) {
+            data.insert(data.end(), {static_cast<uint8_t>(length), row[j]});
+            j += length;
+            continue;
         }
-        uint32_t zero = 0;
-        Write(f, zero, padding);
+        size_t end = j + length;
+        while (end < width && end - j < RLE_MAX_RUN && RunLength(row, end, width) < RLE_MIN_LITERAL) {
+            ++end;
+        }
+        if (end - j < RLE_MIN_LITERAL) {
+            for (; j < end; ++j) {
+                data.insert(data.end(), {1, row[j]});
+            }
+            continue;
+        }
+        data.insert(data.end(), {RLE_ESCAPE, static_cast<uint8_t>(end - j)});
+        data.insert(data.end(), row + j, row + end);
+        if ((end - j) % 2 != 0) {
+            data.push_back(0);
+        }
+        j = end;
+    }
+}
+
+// GRAY8 images keep the gray palette, color ones get a palette of their colors in the order they are met.
+// Returns false, having written nothing, if the image cannot be paletted or does not get smaller.
+bool BMP::WriteRLE8(std::ostream &f) {
+    if (!alpha.Empty()) {
+        return false;
+    }
+    size_t width = image.Width();
+    size_t height = image.Height();
+    bool gray = image.Format() == PixelFormat::GRAY8;
+    std::vector<Pixel8> colors;
+    std::unordered_map<uint32_t, uint8_t> color_indices;
+    std::vector<Pixel8> pixels(width);
+    std::vector<uint8_t> indices(width);
+    std::vector<uint8_t> data;
+    for (size_t i = height; i--;) {
+        const uint8_t *row = gray ? image.Row<uint8_t>(i) : indices.data();
+        if (!gray) {
+            const Pixel8 *src = image.Row<Pixel8>(i);
+            if (image.Format() == PixelFormat::RGBF32) {
+                PackBGR8Row(image.Row(i), pixels.data(), width);
+                src = pixels.data();
+            }
+            // Flat images repeat the previous color most of the time, which saves the lookup.
+            uint32_t last_key = UINT32_MAX;
+            uint8_t last_index = 0;
+            for (size_t j = 0; j < width; ++j) {
+                uint32_t key = src[j].blue | src[j].green << 8 | src[j].red << 16;
+                if (key != last_key) {
+                    auto [it, inserted] = color_indices.try_emplace(key, static_cast<uint8_t>(colors.size()));
+                    if (inserted) {
+                        if (colors.size() == PALETTE_SIZE) {
+                            return false;
+                        }
+                        colors.push_back(src[j]);
+                    }
+                    last_key = key;
+                    last_index = it->second;
+                }
+                indices[j] = last_index;
+            }
+        }
+        EncodeRLE8Row(row, width, data);
+        data.insert(data.end(), {RLE_ESCAPE, i == 0 ? RLE_END_OF_BITMAP : RLE_END_OF_LINE});
+    }
+    if (height == 0) {
+        data.insert(data.end(), {RLE_ESCAPE, RLE_END_OF_BITMAP});
+    }
+    // Noisy images can grow; they are written as usual then.
+    if (data.size() >= static_cast<size_t>(RowSize(width, gray ? BMP_BI_BIT_COUNT_8 : BMP_BI_BIT_COUNT)) * height) {
+        return false;
+    }
+    SetLayout(BMP_BI_BIT_COUNT_8, false);
+    if (!gray) {
+        // An empty color table would mean a full one.
+        palette = colors.empty() ? std::vector<Pixel8>{{0, 0, 0}} : colors;
+        bmp_ih.bi_colors_used = palette.size();
+        bmp_ih.bi_colors_important = 0;
+        bmp_fh.bf_offset = BMP_FILE_HEADER_SIZE + bmp_ih.bi_size + palette.size() * PALETTE_ENTRY_SIZE;
+    }
+    bmp_ih.bi_compression = BMP_BI_RLE8;
+    bmp_ih.bi_width = width;
+    bmp_ih.bi_height = height;
+    bmp_ih.bi_image_size = data.size();
+    bmp_fh.bf_size = bmp_fh.bf_offset + bmp_ih.bi_image_size;
+    WriteAllHeaders(f);
+    f.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+    return true;
+}
+
+void BMP::WriteBMP(std::ostream &f, bool rle) {
+    if (rle && WriteRLE8(f)) {
+        return;
+    }
+    uint32_t row_size = UpdateHeaders();
+    WriteAllHeaders(f);
+    const Image *src_alpha = alpha.Empty() ? nullptr : &alpha;
+    size_t rows_per_block = RowsPerBlock(row_size);
+    std::vector<char> block(rows_per_block * row_size, 0);
+    for (size_t done = 0; done < bmp_ih.bi_height;) {
+        size_t rows = std::min<size_t>(rows_per_block, bmp_ih.bi_height - done);
+        for (size_t k = 0; k < rows; ++k) {
+            EncodeRow(image, bmp_ih.bi_height - 1 - (done + k), src_alpha,
+                      reinterpret_cast<uint8_t *>(block.data() + k * row_size));
+        }
+        f.write(block.data(), static_cast<std::streamsize>(rows * row_size));
+        done += rows;
+    }
+}
+
+void BMP::WriteHeaders(std::ostream &f, size_t width, size_t height) {
+    SetLayout(bmp_ih.bi_bit_count == BMP_BI_BIT_COUNT_32 ? BMP_BI_BIT_COUNT_32 : BMP_BI_BIT_COUNT, false);
+    bmp_ih.bi_width = width;
+    bmp_ih.bi_height = height;
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    bmp_ih.bi_image_size = row_size * bmp_ih.bi_height;
+    bmp_fh.bf_size = bmp_fh.bf_offset + bmp_ih.bi_image_size;
+    WriteAllHeaders(f);
+}
+
+void BMP::WriteRows(std::ostream &f, size_t begin, const Image &src) const {
+    uint32_t row_size = RowSize(bmp_ih.bi_width, bmp_ih.bi_bit_count);
+    size_t rows = src.Height();
+    std::vector<char> block(rows * row_size, 0);
+    for (size_t k = 0; k < rows; ++k) {
+        EncodeRow(src, rows - 1 - k, nullptr, reinterpret_cast<uint8_t *>(block.data() + k * row_size));
+    }
+    f.seekp(bmp_fh.bf_offset + static_cast<std::streamoff>(row_size) * (bmp_ih.bi_height - begin - rows),
+            std::ios_base::beg);
+    f.write(block.data(), static_cast<std::streamsize>(block.size()));
+}
+
+void BMP::WriteMappedBMP(const std::string &path) {
+    uint32_t row_size = UpdateHeaders();
+    std::ostringstream headers;
+    WriteAllHeaders(headers);
+    std::shared_ptr<MappedFile> file = MappedFile::Create(path, bmp_fh.bf_size);
+    uint8_t *dst = file->Data();
+    std::string header_bytes = headers.str();
+    std::copy(header_bytes.begin(), header_bytes.end(), dst);
+    dst += header_bytes.size();
+    const Image *src_alpha = alpha.Empty() ? nullptr : &alpha;
+    size_t encoded_size = image.Width() * (bmp_ih.bi_bit_count >> BYTE);
+    for (size_t i = bmp_ih.bi_height; i--;) {
+        EncodeRow(image, i, src_alpha, dst);
+        std::fill(dst + encoded_size, dst + row_size, 0);
+        dst += row_size;
     }
 }
 
@@ -121,42 +708,7 @@ void BMP::WriteBMP(std::ofstream &f) {
 //     std::cout << std::endl;
 // }
 
-void RelaxToNearest(int32_t &x, int32_t &y, int32_t h, int32_t w) {
-    if (x < 0) {
-        x = 0;
-    } else if (x >= h) {
-        x = h - 1;
-    }
-    if (y < 0) {
-        y = 0;
-    } else if (y >= w) {
-        y = w - 1;
-    }
-}
-
-void ApplyMatrixForBMP(BMP &bmp, const Matrix &applied_matrix, int32_t delta) {
-    std::vector<std::vector<Pixel>> old_data = bmp.data;
-    int32_t height = static_cast<int32_t>(bmp.bmp_ih.bi_height);
-    int32_t width = static_cast<int32_t>(bmp.bmp_ih.bi_width);
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            std::array<double, 3> color_result = {0, 0, 0};
-            for (int32_t delta_i = -delta; delta_i <= delta; ++delta_i) {
-                for (int32_t delta_j = -delta; delta_j <= delta; ++delta_j) {
-                    int32_t x = i + delta_i;
-                    int32_t y = j + delta_j;
-                    RelaxToNearest(x, y, height, width);
-                    color_result[0] += old_data[x][y].red * applied_matrix[delta_i + delta][delta_j + delta];
-                    color_result[1] += old_data[x][y].green * applied_matrix[delta_i + delta][delta_j + delta];
-                    color_result[2] += old_data[x][y].blue * applied_matrix[delta_i + delta][delta_j + delta];
-                }
-            }
-            for (size_t k = 0; k < 3; ++k) {
-                color_result[k] = NormalizeValue(color_result[k]);
-            }
-            bmp.data[i][j].red = color_result[0];
-            bmp.data[i][j].green = color_result[1];
-            bmp.data[i][j].blue = color_result[2];
-        }
-    }
-}
\ No newline at end of file
+void ApplyMatrixForBMP(BMP &bmp, const Matrix &applied_matrix) {
+    bmp.image.ConvertTo(PixelFormat::RGBF32);
+    Convolve(bmp.image, ConvKernel(applied_matrix));
+}
@@ -6,6 +6,8 @@
 #include <vector>
 #include <fstream>
 #include "../graphics/graphics.h"
+#include "../graphics/image.h"
+#include "mapped_file.h"
 
 struct BitMapFileHeader {
     uint16_t bf_type;
@@ -14,8 +16,8 @@ struct BitMapFileHeader {
     uint16_t bf_reversed2;
     uint32_t bf_offset;
 
-    void ReadBitMapFileHeader(std::ifstream &f);
-    void WriteBitMapFileHeader(std::ofstream &f);
+    void ReadBitMapFileHeader(std::istream &f);
+    void WriteBitMapFileHeader(std::ostream &f);
 };
 
 struct BitMapInfoHeader {
@@ -30,31 +32,78 @@ struct BitMapInfoHeader {
     uint32_t bi_vert_ppm;
     uint32_t bi_colors_used;
     uint32_t bi_colors_important;
-    void ReadBitMapInfoHeader(std::ifstream &f);
-    void WriteBitMapInfoHeader(std::ofstream &f);
+    // Channel masks of 32-bit images. BI_BITFIELDS files store them, for BI_RGB they are implied.
+    uint32_t bi_red_mask = 0;
+    uint32_t bi_green_mask = 0;
+    uint32_t bi_blue_mask = 0;
+    uint32_t bi_alpha_mask = 0;
+    // Reads BITMAPINFOHEADER and its V2-V5 extensions; only the fields above are kept.
+    void ReadBitMapInfoHeader(std::istream &f);
+    void WriteBitMapInfoHeader(std::ostream &f);
 };
 
 template <typename T>
-void Read(std::ifstream &f, T &result, std::streamsize sz) {
+void Read(std::istream &f, T &result, std::streamsize sz) {
     f.read(reinterpret_cast<char *>(&result), sz);
 }
 
 template <typename T>
-void Write(std::ofstream &f, T &result, std::streamsize sz) {
+void Write(std::ostream &f, T &result, std::streamsize sz) {
     f.write(reinterpret_cast<char *>(&result), sz);
 }
 
+// Reads 24-bit, 32-bit (BI_RGB or BI_BITFIELDS) and 4- and 8-bit paletted files, the latter also
+// RLE-compressed. Images are written back with the depth they were read with: GRAY8 images as 8-bit
+// grayscale, images read from 32-bit files as 32-bit (with their alpha channel, if any) and all others
+// as 24-bit.
 class BMP {
 public:
     BitMapFileHeader bmp_fh;
     BitMapInfoHeader bmp_ih;
-    std::vector<std::vector<Pixel>> data;
+    // Color table of 4- and 8-bit images, always 256 entries long.
+    std::vector<Pixel8> palette;
+    Image image;
+    // Alpha channel of 32-bit images that have one, as a GRAY8 image of the same size; empty otherwise.
+    // Filters only change colors, so it is kept aside and only cropped along with the image.
+    Image alpha;
     BMP() = default;
 
-    void ReadBMP(std::ifstream &f);
-    void WriteBMP(std::ofstream &f);
-};
+    // Only the top-left max_width x max_height part of the image is decoded. GRAY8 is used for
+    // 8-bit files with a gray palette only, the others are decoded as BGR8 then.
+    void ReadBMP(std::istream &f, PixelFormat format = PixelFormat::RGBF32,
+                 size_t max_width = std::numeric_limits<size_t>::max(),
+                 size_t max_height = std::numeric_limits<size_t>::max());
+    // Reads the headers from f and makes image an 8-bit view of the pixel array inside file. Files that
+    // are not 24-bit are decoded by ReadBMP instead.
+    void MapBMP(std::istream &f, const std::shared_ptr<MappedFile> &file, PixelFormat format = PixelFormat::BGR8);
+    // With rle, images of at most 256 colors and without alpha are written as 8-bit RLE, if that is smaller.
+    void WriteBMP(std::ostream &f, bool rle = false);
+    void WriteMappedBMP(const std::string &path);
+
+    bool HasAlpha() const;
+    // Whether the file is 4- or 8-bit with a palette of grays only.
+    bool IsGray() const;
+    bool IsRLE() const;
 
-void ApplyMatrixForBMP(BMP &bmp, const Matrix &applied_matrix, int32_t delta = 1);
+    // Band access for streaming; rows are numbered from the top of the image, as in Image.
+    void ReadHeaders(std::istream &f);
+    // Decodes rows [begin, begin + dst.Height()) of the image, dst.Width() pixels of each, into float dst.
+    // RLE files cannot be read this way.
+    void ReadRows(std::istream &f, size_t begin, Image &dst) const;
+    // Writes the headers of a width x height color image without alpha.
+    void WriteHeaders(std::ostream &f, size_t width, size_t height);
+    // Writes src as rows [begin, begin + src.Height()) of an image whose headers were written by WriteHeaders.
+    void WriteRows(std::ostream &f, size_t begin, const Image &src) const;
+
+private:
+    void SetLayout(uint16_t bit_count, bool has_alpha);
+    uint32_t UpdateHeaders();
+    void WriteAllHeaders(std::ostream &f);
+    void DecodeRow(const uint8_t *src, Image &dst, size_t i, Image *dst_alpha) const;
+    void DecodeIndices(const uint8_t *indices, Image &dst, size_t i) const;
+    void ReadRLE(std::istream &f);
+    bool WriteRLE8(std::ostream &f);
+    void EncodeRow(const Image &src, size_t i, const Image *src_alpha, uint8_t *dst) const;
+};
 
-void RelaxToNearest(int32_t &x, int32_t &y, int32_t h, int32_t w);
\ No newline at end of file
+void ApplyMatrixForBMP(BMP &bmp, const Matrix &applied_matrix);
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+#include "../exceptions/exceptions.h"
+
+MappedFile::MappedFile(int fd, size_t size, bool writable) : fd_(fd), size_(size) {
+    if (size_ == 0) {
+        return;
+    }
+    int flags = writable ? MAP_SHARED : MAP_PRIVATE;
+    void *ptr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, flags, fd_, 0);
+    if (ptr == MAP_FAILED) {
+        close(fd_);
+        throw BMPExceptions(MAPPING_FAILED);
+    }
+    data_ = static_cast<uint8_t *>(ptr);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+    if (fd_ != -1) {
+        close(fd_);
+    }
+}
+
+std::shared_ptr<MappedFile> MappedFile::OpenRead(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw OptionExceptions(INVALID_INPUT_FILE);
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw OptionExceptions(INVALID_INPUT_FILE);
+    }
+    auto file = std::shared_ptr<MappedFile>(new MappedFile(fd, static_cast<size_t>(st.st_size), false));
+#ifdef MADV_SEQUENTIAL
+    if (file->data_ != nullptr) {
+        madvise(file->data_, file->size_, MADV_SEQUENTIAL);
+    }
+#endif
+    return file;
+}
+
+std::shared_ptr<MappedFile> MappedFile::Create(const std::string &path, size_t size) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw OptionExceptions(INVALID_OUTPUT_FILE);
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+        close(fd);
+        throw BMPExceptions(MAPPING_FAILED);
+    }
+    return std::shared_ptr<MappedFile>(new MappedFile(fd, size, true));
+}
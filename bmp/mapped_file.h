@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Memory mapping of a whole file. Input mappings are private (copy-on-write), so pixels can be
+// modified in place without ever touching the file; output mappings are shared and pre-sized.
+class MappedFile {
+public:
+    static std::shared_ptr<MappedFile> OpenRead(const std::string &path);
+    static std::shared_ptr<MappedFile> Create(const std::string &path, size_t size);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    uint8_t *Data() {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    MappedFile(int fd, size_t size, bool writable);
+
+    int fd_ = -1;
+    size_t size_ = 0;
+    uint8_t *data_ = nullptr;
+};
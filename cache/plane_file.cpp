@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include "plane_file.h"
+#include "../exceptions/exceptions.h"
+
+const size_t MAX_PLANES = 32;
+const size_t PAGE_SIZE = 4096;
+// "IPPLANE1" read as a little-endian number; the digit is the version of the layout below.
+const uint64_t PLANE_FILE_MAGIC = 0x31454E414C505049;
+const std::string TEMPORARY_SUFFIX = ".tmp";
+
+struct StoredPlane {
+    uint64_t format;
+    uint64_t width;
+    uint64_t height;
+    uint64_t stride;
+    uint64_t offset;
+};
+
+struct PlaneFileHeader {
+    uint64_t magic;
+    uint64_t planes;
+    BitMapFileHeader file_header;
+    BitMapInfoHeader info_header;
+    StoredPlane plane[MAX_PLANES];
+};
+
+const PlaneFileHeader &HeaderOf(MappedFile &file) {
+    return *reinterpret_cast<const PlaneFileHeader *>(file.Data());
+}
+
+void WriteZeros(std::ostream &out, size_t count) {
+    std::vector<char> zeros(count, 0);
+    out.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+}
+
+void PlaneFile::Write(const std::filesystem::path &path, const BMP &bmp, const std::vector<const Image *> &planes) {
+    if (planes.size() > MAX_PLANES) {
+        throw BMPExceptions(CACHE_ENTRY);
+    }
+    PlaneFileHeader header = {};
+    header.magic = PLANE_FILE_MAGIC;
+    header.planes = planes.size();
+    header.file_header = bmp.bmp_fh;
+    header.info_header = bmp.bmp_ih;
+    size_t offset = AlignUp(sizeof(header), PAGE_SIZE);
+    for (size_t k = 0; k < planes.size(); ++k) {
+        const Image &image = *planes[k];
+        size_t stride = AlignUp(image.Width() * BytesPerPixel(image.Format()), sizeof(uint64_t));
+        header.plane[k] = {static_cast<uint64_t>(image.Format()), image.Width(), image.Height(), stride, offset};
+        offset = AlignUp(offset + stride * image.Height(), PAGE_SIZE);
+    }
+
+    std::filesystem::path temporary = path;
+    temporary += TEMPORARY_SUFFIX + std::to_string(getpid()) + "_" +
+                 std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream out(temporary, std::ofstream::binary);
+    if (!out.is_open()) {
+        throw OptionExceptions(INVALID_CACHE_DIR);
+    }
+    ::Write(out, header, sizeof(header));
+    size_t written = sizeof(header);
+    for (size_t k = 0; k < planes.size(); ++k) {
+        const Image &image = *planes[k];
+        const StoredPlane &stored = header.plane[k];
+        WriteZeros(out, stored.offset - written);
+        // Views may have any stride, so rows are written one by one.
+        size_t row_size = image.Width() * BytesPerPixel(image.Format());
+        for (size_t i = 0; i < image.Height(); ++i) {
+            out.write(reinterpret_cast<const char *>(image.Row<uint8_t>(i)), static_cast<std::streamsize>(row_size));
+            WriteZeros(out, stored.stride - row_size);
+        }
+        written = stored.offset + stored.stride * stored.height;
+    }
+    out.close();
+    if (!out) {
+        std::filesystem::remove(temporary);
+        throw OptionExceptions(INVALID_CACHE_DIR);
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+PlaneFile::PlaneFile(const std::filesystem::path &path) : file_(MappedFile::OpenRead(path)) {
+    if (file_->Size() < sizeof(PlaneFileHeader)) {
+        throw BMPExceptions(CACHE_ENTRY);
+    }
+    const PlaneFileHeader &header = HeaderOf(*file_);
+    if (header.magic != PLANE_FILE_MAGIC || header.planes > MAX_PLANES) {
+        throw BMPExceptions(CACHE_ENTRY);
+    }
+    for (size_t k = 0; k < header.planes; ++k) {
+        const StoredPlane &plane = header.plane[k];
+        if (plane.format > static_cast<uint64_t>(PixelFormat::GRAY8) || plane.offset % PAGE_SIZE != 0 ||
+            plane.offset + plane.stride * plane.height > file_->Size()) {
+            throw BMPExceptions(CACHE_ENTRY);
+        }
+    }
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+}
+
+size_t PlaneFile::Planes() const {
+    return HeaderOf(*file_).planes;
+}
+
+size_t PlaneFile::Width(size_t plane) const {
+    return HeaderOf(*file_).plane[plane].width;
+}
+
+size_t PlaneFile::Height(size_t plane) const {
+    return HeaderOf(*file_).plane[plane].height;
+}
+
+Image PlaneFile::Plane(size_t plane) const {
+    const StoredPlane &stored = HeaderOf(*file_).plane[plane];
+    return Image::Wrap(file_, file_->Data() + stored.offset, stored.width, stored.height,
+                       static_cast<ptrdiff_t>(stored.stride), static_cast<PixelFormat>(stored.format));
+}
+
+void PlaneFile::LoadHeaders(BMP &bmp) const {
+    bmp.bmp_fh = HeaderOf(*file_).file_header;
+    bmp.bmp_ih = HeaderOf(*file_).info_header;
+    bmp.palette.clear();
+}
+
+void TrimCacheDir(const std::string &dir, size_t max_bytes) {
+    struct CacheFile {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        size_t size;
+    };
+    std::vector<CacheFile> files;
+    size_t total = 0;
+    std::error_code error;
+    for (const auto &item : std::filesystem::directory_iterator(dir, error)) {
+        // Files being written by other runs are left alone.
+        if (!item.is_regular_file(error) || item.path().string().find(TEMPORARY_SUFFIX) != std::string::npos) {
+            continue;
+        }
+        files.push_back({item.path(), item.last_write_time(error), static_cast<size_t>(item.file_size(error))});
+        total += files.back().size;
+    }
+    std::sort(files.begin(), files.end(), [](const CacheFile &a, const CacheFile &b) { return a.used < b.used; });
+    for (const CacheFile &file : files) {
+        if (total <= max_bytes) {
+            break;
+        }
+        // Another run may have removed it already; mapped files stay readable after removal.
+        std::filesystem::remove(file.path, error);
+        total -= file.size;
+    }
+}
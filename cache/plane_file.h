@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../bmp/bmp.h"
+
+// Cache file of raw image planes at page-aligned offsets, with the BMP headers of the image they came
+// from. Planes are used straight from the mapped file, so loading one costs no decoding or copying.
+class PlaneFile {
+public:
+    // Writes under a temporary name and renames, so other runs never see a half-written file.
+    static void Write(const std::filesystem::path &path, const BMP &bmp, const std::vector<const Image *> &planes);
+
+    // Maps the file and marks it as just used for TrimCacheDir; throws BMPExceptions if it is not a plane file.
+    explicit PlaneFile(const std::filesystem::path &path);
+
+    size_t Planes() const;
+    size_t Width(size_t plane) const;
+    size_t Height(size_t plane) const;
+    // View of the plane inside the mapping; the mapping is private, so the view may be modified.
+    Image Plane(size_t plane) const;
+    void LoadHeaders(BMP &bmp) const;
+
+private:
+    std::shared_ptr<MappedFile> file_;
+};
+
+// Removes the least recently used cache files of dir until they take at most max_bytes.
+void TrimCacheDir(const std::string &dir, size_t max_bytes);
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <type_traits>
+#include "pyramid_cache.h"
+#include "../exceptions/exceptions.h"
+#include "../parallel/thread_pool.h"
+
+const size_t MIN_PYRAMID_SIZE = 32;
+const size_t MAX_PYRAMID_LEVELS = 32;
+const std::string ENTRY_EXTENSION = ".pyr";
+const size_t HASH_LANES = 4;
+const int HASH_ROTATION = 31;
+const uint64_t HASH_PRIME_1 = 0x9E3779B185EBCA87;
+const uint64_t HASH_PRIME_2 = 0xC2B2AE3D27D4EB4F;
+const uint64_t HASH_PRIME_3 = 0x165667B19E3779F9;
+
+uint64_t MixHash(uint64_t hash, uint64_t word) {
+    return std::rotl(hash + word * HASH_PRIME_2, HASH_ROTATION) * HASH_PRIME_1;
+}
+
+uint64_t ContentHash(const uint8_t *data, size_t size) {
+    // Independent lanes let the multiplications of neighbouring words overlap.
+    uint64_t lanes[HASH_LANES] = {HASH_PRIME_1, HASH_PRIME_2, HASH_PRIME_3, 0};
+    const size_t block = HASH_LANES * sizeof(uint64_t);
+    size_t k = 0;
+    for (; k + block <= size; k += block) {
+        for (size_t lane = 0; lane < HASH_LANES; ++lane) {
+            uint64_t word = 0;
+            std::memcpy(&word, data + k + lane * sizeof(uint64_t), sizeof(word));
+            lanes[lane] = MixHash(lanes[lane], word);
+        }
+    }
+    uint64_t hash = size;
+    for (uint64_t lane : lanes) {
+        hash = MixHash(hash, lane);
+    }
+    for (; k < size; ++k) {
+        hash = MixHash(hash, data[k]);
+    }
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    return hash ^ (hash >> 32);
+}
+
+template <typename C>
+void HalveRows(const Image &image, Image &res) {
+    size_t channels = BytesPerPixel(image.Format()) / sizeof(C);
+    size_t width = res.Width();
+    ParallelFor(0, res.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const C *top = image.Row<C>(2 * i);
+            const C *bottom = image.Row<C>(2 * i + 1);
+            C *dst = res.Row<C>(i);
+            for (size_t j = 0; j < width; ++j) {
+                for (size_t c = 0; c < channels; ++c) {
+                    size_t left = 2 * j * channels + c;
+                    if constexpr (std::is_same_v<C, float>) {
+                        dst[j * channels + c] =
+                            (top[left] + top[left + channels] + bottom[left] + bottom[left + channels]) * 0.25f;
+                    } else {
+                        dst[j * channels + c] = static_cast<C>(
+                            (top[left] + top[left + channels] + bottom[left] + bottom[left + channels] + 2) / 4);
+                    }
+                }
+            }
+        }
+    });
+}
+
+Image HalveImage(const Image &image) {
+    Image res(image.Width() / 2, image.Height() / 2, image.Format());
+    if (image.Format() == PixelFormat::RGBF32) {
+        HalveRows<float>(image, res);
+    } else {
+        HalveRows<uint8_t>(image, res);
+    }
+    return res;
+}
+
+size_t PyramidLevels(size_t width, size_t height) {
+    size_t levels = 1;
+    while (levels < MAX_PYRAMID_LEVELS && (width >> levels) >= MIN_PYRAMID_SIZE &&
+           (height >> levels) >= MIN_PYRAMID_SIZE) {
+        ++levels;
+    }
+    return levels;
+}
+
+PyramidEntry::PyramidEntry(const std::filesystem::path &path) : file_(path) {
+    if (file_.Planes() == 0 || file_.Planes() > MAX_PYRAMID_LEVELS) {
+        throw BMPExceptions(CACHE_ENTRY);
+    }
+    for (size_t k = 0; k < file_.Planes(); ++k) {
+        PixelFormat format = file_.Plane(k).Format();
+        if (format != PixelFormat::BGR8 && format != PixelFormat::GRAY8) {
+            throw BMPExceptions(CACHE_ENTRY);
+        }
+    }
+}
+
+size_t PyramidEntry::Levels() const {
+    return file_.Planes();
+}
+
+size_t PyramidEntry::Width(size_t level) const {
+    return file_.Width(level);
+}
+
+size_t PyramidEntry::Height(size_t level) const {
+    return file_.Height(level);
+}
+
+void PyramidEntry::Load(size_t level, BMP &bmp, PixelFormat format) const {
+    file_.LoadHeaders(bmp);
+    bmp.alpha = Image();
+    bmp.image = file_.Plane(level);
+    if (format == PixelFormat::RGBF32) {
+        bmp.image.ConvertTo(format);
+    }
+}
+
+void WriteEntry(const std::filesystem::path &path, BMP &bmp) {
+    std::vector<Image> levels;
+    levels.push_back(std::move(bmp.image));
+    size_t count = PyramidLevels(levels[0].Width(), levels[0].Height());
+    while (levels.size() < count) {
+        levels.push_back(HalveImage(levels.back()));
+    }
+    std::vector<const Image *> planes;
+    for (const Image &level : levels) {
+        planes.push_back(&level);
+    }
+    PlaneFile::Write(path, bmp, planes);
+}
+
+uint64_t FileHash(const std::string &path) {
+    std::shared_ptr<MappedFile> file = MappedFile::OpenRead(path);
+    return ContentHash(file->Data(), file->Size());
+}
+
+PyramidCache::PyramidCache(const std::string &dir) : dir_(dir) {
+    std::error_code error;
+    std::filesystem::create_directories(dir_, error);
+    if (error) {
+        throw OptionExceptions(INVALID_CACHE_DIR);
+    }
+}
+
+std::optional<PyramidEntry> PyramidCache::Open(uint64_t hash, std::istream &input) const {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << hash << ENTRY_EXTENSION;
+    std::filesystem::path entry_path = std::filesystem::path(dir_) / name.str();
+    if (std::filesystem::exists(entry_path)) {
+        try {
+            return PyramidEntry(entry_path);
+        } catch (const BMPExceptions &) {
+            // A corrupt entry is replaced below.
+        }
+    }
+    BMP bmp;
+    bmp.ReadHeaders(input);
+    input.seekg(0, std::ios_base::beg);
+    if (bmp.HasAlpha()) {
+        return std::nullopt;
+    }
+    bmp.ReadBMP(input, PixelFormat::GRAY8);
+    WriteEntry(entry_path, bmp);
+    return PyramidEntry(entry_path);
+}
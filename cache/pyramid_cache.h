@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include "plane_file.h"
+
+// Hash of a byte range, used to key cache entries by file contents.
+uint64_t ContentHash(const uint8_t *data, size_t size);
+// ContentHash of the whole file at path.
+uint64_t FileHash(const std::string &path);
+
+// Averages every 2x2 block of an 8-bit image; odd last rows and columns are dropped.
+Image HalveImage(const Image &image);
+
+// Number of pyramid levels of a width x height image: each level halves the previous one, and levels
+// smaller than MIN_PYRAMID_SIZE on either side are not made.
+size_t PyramidLevels(size_t width, size_t height);
+
+// Decoded image and its pyramid, as stored in one cache file: one 8-bit plane per level.
+class PyramidEntry {
+public:
+    explicit PyramidEntry(const std::filesystem::path &path);
+
+    size_t Levels() const;
+    size_t Width(size_t level) const;
+    size_t Height(size_t level) const;
+    // Makes bmp a view of the given level; the image is converted only if format is RGBF32.
+    void Load(size_t level, BMP &bmp, PixelFormat format) const;
+
+private:
+    PlaneFile file_;
+};
+
+// On-disk cache of decoded images keyed by a hash of the file contents, one file per image in dir.
+// Images with alpha are not cached.
+class PyramidCache {
+public:
+    explicit PyramidCache(const std::string &dir);
+
+    // Entry for the BMP file with FileHash hash, which input reads; on a miss the file is decoded and
+    // the entry written first. Returns nothing for images that are not cached.
+    std::optional<PyramidEntry> Open(uint64_t hash, std::istream &input) const;
+
+private:
+    std::string dir_;
+};
@@ -0,0 +1,65 @@
+#include <iomanip>
+#include <sstream>
+#include "result_cache.h"
+#include "plane_file.h"
+#include "pyramid_cache.h"
+#include "../exceptions/exceptions.h"
+
+const std::string RESULT_EXTENSION = ".stage";
+
+uint64_t InputKey(uint64_t hash, size_t level, PixelFormat format) {
+    const uint64_t words[] = {hash, level, static_cast<uint64_t>(format)};
+    return ContentHash(reinterpret_cast<const uint8_t *>(words), sizeof(words));
+}
+
+uint64_t StageKey(uint64_t key, const Filter &stage) {
+    std::string bytes(reinterpret_cast<const char *>(&key), sizeof(key));
+    bytes += stage.Key();
+    return ContentHash(reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size());
+}
+
+std::filesystem::path ResultPath(const std::string &dir, uint64_t key) {
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << key << RESULT_EXTENSION;
+    return std::filesystem::path(dir) / name.str();
+}
+
+ResultCache::ResultCache(const std::string &dir, size_t max_bytes) : dir_(dir), max_bytes_(max_bytes) {
+    std::error_code error;
+    std::filesystem::create_directories(dir_, error);
+    if (error) {
+        throw OptionExceptions(INVALID_CACHE_DIR);
+    }
+}
+
+bool ResultCache::Load(uint64_t key, BMP &bmp) const {
+    std::filesystem::path path = ResultPath(dir_, key);
+    if (!std::filesystem::exists(path)) {
+        return false;
+    }
+    try {
+        PlaneFile file(path);
+        if (file.Planes() == 0 || file.Planes() > 2) {
+            return false;
+        }
+        file.LoadHeaders(bmp);
+        bmp.image = file.Plane(0);
+        bmp.alpha = file.Planes() == 2 ? file.Plane(1) : Image();
+        return true;
+    } catch (const std::runtime_error &) {
+        // A corrupt entry, or one evicted by another run meanwhile, is recomputed.
+        return false;
+    }
+}
+
+void ResultCache::Store(uint64_t key, const BMP &bmp) const {
+    std::vector<const Image *> planes = {&bmp.image};
+    if (!bmp.alpha.Empty()) {
+        planes.push_back(&bmp.alpha);
+    }
+    PlaneFile::Write(ResultPath(dir_, key), bmp, planes);
+}
+
+void ResultCache::Trim() const {
+    TrimCacheDir(dir_, max_bytes_);
+}
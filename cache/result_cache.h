@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "../bmp/bmp.h"
+#include "../filters/filters.h"
+
+// Key of an image read from the file with FileHash hash, at the given pyramid level and in the given format.
+uint64_t InputKey(uint64_t hash, size_t level, PixelFormat format);
+
+// Key of the result of stage applied to the image with the given key.
+uint64_t StageKey(uint64_t key, const Filter &stage);
+
+// On-disk cache of the images after each stage of a chain, one file per image in dir. Files of the
+// directory are evicted least recently used first once they take more than max_bytes.
+class ResultCache {
+public:
+    ResultCache(const std::string &dir, size_t max_bytes);
+
+    // Makes bmp a view of the cached image with the given key; returns false if there is none.
+    bool Load(uint64_t key, BMP &bmp) const;
+    void Store(uint64_t key, const BMP &bmp) const;
+    // Evicts files until the directory fits into max_bytes.
+    void Trim() const;
+
+private:
+    std::string dir_;
+    size_t max_bytes_;
+};
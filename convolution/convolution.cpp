@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <utility>
+#include "convolution.h"
+#include "../parallel/thread_pool.h"
+
+const size_t CHANNELS = sizeof(Pixel) / sizeof(float);
+const size_t MIN_BAND_ROWS = 16;
+const size_t BANDS_PER_THREAD = 4;
+const float SEPARABLE_EPS = 1e-6f;
+
+ConvKernel::ConvKernel(const Matrix &matrix) : rows(matrix.n), cols(matrix.m) {
+    size_t pivot = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            weights.push_back(static_cast<float>(matrix[i][j]));
+            if (std::abs(weights.back()) > std::abs(weights[pivot])) {
+                pivot = weights.size() - 1;
+            }
+        }
+    }
+    float max_weight = std::abs(weights[pivot]);
+    if (max_weight == 0) {
+        return;
+    }
+    size_t pivot_row = pivot / cols;
+    size_t pivot_col = pivot % cols;
+    for (size_t i = 0; i < rows; ++i) {
+        column.push_back(weights[i * cols + pivot_col]);
+    }
+    for (size_t j = 0; j < cols; ++j) {
+        row.push_back(weights[pivot_row * cols + j] / weights[pivot]);
+    }
+    size_t nonzero = 0;
+    separable = true;
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            nonzero += weights[i * cols + j] != 0;
+            separable &= std::abs(weights[i * cols + j] - column[i] * row[j]) <= SEPARABLE_EPS * max_weight;
+        }
+    }
+    separable &= rows + cols < nonzero;
+}
+
+// Copies a source row of pixels with the given number of channels, with pad pixels repeated on both sides.
+template <typename C>
+void LoadPaddedRow(const C *row, size_t width, size_t channels, size_t pad, C *dst) {
+    for (size_t j = 0; j < pad; ++j) {
+        std::copy(row, row + channels, dst + j * channels);
+        std::copy(row + (width - 1) * channels, row + width * channels, dst + (pad + width + j) * channels);
+    }
+    std::copy(row, row + width * channels, dst + pad * channels);
+}
+
+void AddScaled(float *__restrict dst, const float *__restrict src, float weight, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        dst[k] += weight * src[k];
+    }
+}
+
+// Source rows of the window, top to bottom, each padded by the kernel's half width. C is the channel
+// type: float for RGBF32 images and uint8_t for BGR8 and GRAY8 ones.
+template <typename C>
+using WindowRows = std::vector<const C *>;
+template <typename C>
+using RowKernel = std::function<void(const WindowRows<C> &, C *)>;
+
+// Calls convolve_row(window, output_row) for every row of the image, band by band.
+template <typename C>
+void ConvolveBands(Image &image, size_t kernel_rows, size_t kernel_cols, const RowKernel<C> &convolve_row) {
+    size_t height = image.Height();
+    size_t width = image.Width();
+    size_t channels = BytesPerPixel(image.Format()) / sizeof(C);
+    size_t pad_rows = kernel_rows / 2;
+    size_t pad_cols = kernel_cols / 2;
+    size_t padded = (width + 2 * pad_cols) * channels;
+    size_t threads = ThreadPool::Global().Size();
+    size_t band_rows = std::max(MIN_BAND_ROWS, (height + threads * BANDS_PER_THREAD - 1) / (threads * BANDS_PER_THREAD));
+    size_t bands = (height + band_rows - 1) / band_rows;
+    auto clamp_row = [&](ptrdiff_t x) {
+        return static_cast<size_t>(std::clamp<ptrdiff_t>(x, 0, static_cast<ptrdiff_t>(height) - 1));
+    };
+
+    // Rows just outside a band are overwritten by its neighbours, so they are saved before any band starts.
+    std::vector<std::vector<C>> above(bands);
+    std::vector<std::vector<C>> below(bands);
+    ParallelFor(0, bands, [&](size_t band_begin, size_t band_end) {
+        for (size_t band = band_begin; band < band_end; ++band) {
+            ptrdiff_t begin = static_cast<ptrdiff_t>(band * band_rows);
+            ptrdiff_t end = static_cast<ptrdiff_t>(std::min(height, (band + 1) * band_rows));
+            above[band].resize(pad_rows * padded);
+            below[band].resize(pad_rows * padded);
+            for (size_t d = 0; d < pad_rows; ++d) {
+                LoadPaddedRow(image.Row<C>(clamp_row(begin - static_cast<ptrdiff_t>(pad_rows - d))), width, channels,
+                              pad_cols, above[band].data() + d * padded);
+                LoadPaddedRow(image.Row<C>(clamp_row(end + static_cast<ptrdiff_t>(d))), width, channels, pad_cols,
+                              below[band].data() + d * padded);
+            }
+        }
+    });
+
+    ParallelFor(
+        0, bands,
+        [&](size_t band_begin, size_t band_end) {
+            std::vector<C> window(kernel_rows * padded);
+            WindowRows<C> rows(kernel_rows);
+            for (size_t band = band_begin; band < band_end; ++band) {
+                size_t begin = band * band_rows;
+                size_t end = std::min(height, begin + band_rows);
+                // Row x of the source lives in the window slot (x - begin + pad_rows) % kernel_rows.
+                auto slot = [&](size_t x_shifted) { return window.data() + (x_shifted % kernel_rows) * padded; };
+                auto load = [&](size_t x_shifted) {
+                    C *dst = slot(x_shifted);
+                    if (x_shifted < pad_rows) {
+                        std::copy_n(above[band].data() + x_shifted * padded, padded, dst);
+                    } else if (x_shifted - pad_rows >= end - begin) {
+                        std::copy_n(below[band].data() + (x_shifted - pad_rows - (end - begin)) * padded, padded, dst);
+                    } else {
+                        LoadPaddedRow(image.Row<C>(begin + x_shifted - pad_rows), width, channels, pad_cols, dst);
+                    }
+                };
+                for (size_t x_shifted = 0; x_shifted + 1 < kernel_rows; ++x_shifted) {
+                    load(x_shifted);
+                }
+                for (size_t i = begin; i < end; ++i) {
+                    size_t top = i - begin;
+                    load(top + kernel_rows - 1);
+                    for (size_t di = 0; di < kernel_rows; ++di) {
+                        rows[di] = slot(top + di);
+                    }
+                    convolve_row(rows, image.Row<C>(i));
+                }
+            }
+        },
+        1);
+}
+
+template <const auto &K, size_t Tap, typename Acc, typename C>
+inline void AddTap(Acc &sum, C value) {
+    constexpr size_t COLS = K.weights[0].size();
+    constexpr Acc WEIGHT = static_cast<Acc>(K.weights[Tap / COLS][Tap % COLS]);
+    static_assert(WEIGHT == K.weights[Tap / COLS][Tap % COLS], "weights must fit the accumulator type");
+    if constexpr (WEIGHT == 1) {
+        sum += value;
+    } else if constexpr (WEIGHT == -1) {
+        sum -= value;
+    } else if constexpr (WEIGHT != 0) {
+        sum += WEIGHT * value;
+    }
+}
+
+// Float channels are summed in float and clamped to [0, 1]; 8-bit channels are summed exactly in
+// 16-bit integers and clamped to [0, 255], which gives the same bytes as the float path for integer weights.
+// The tap pointers are copied to a local array first: 8-bit stores may alias anything, so otherwise
+// the compiler would reload them from the window on every channel and not vectorize the loop.
+template <const auto &K, typename C, typename Acc, size_t... Taps>
+void ConvolveFixedRow(const WindowRows<C> &rows, C *__restrict dst, size_t count, size_t channels, Acc max,
+                      std::index_sequence<Taps...>) {
+    constexpr size_t COLS = K.weights[0].size();
+    const C *const taps[] = {(rows[Taps / COLS] + Taps % COLS * channels)...};
+    for (size_t k = 0; k < count; ++k) {
+        Acc sum = 0;
+        (AddTap<K, Taps>(sum, taps[Taps][k]), ...);
+        dst[k] = static_cast<C>(std::clamp<Acc>(sum, 0, max));
+    }
+}
+
+template <size_t Rows, size_t Cols>
+constexpr float AbsWeightSum(const Kernel<Rows, Cols> &kernel) {
+    float sum = 0;
+    for (const auto &row : kernel.weights) {
+        for (float weight : row) {
+            sum += weight < 0 ? -weight : weight;
+        }
+    }
+    return sum;
+}
+
+template <const auto &K>
+void ConvolveFixed(Image &image) {
+    constexpr size_t ROWS = K.weights.size();
+    constexpr size_t COLS = K.weights[0].size();
+    if (image.Empty()) {
+        return;
+    }
+    if (image.Format() != PixelFormat::RGBF32) {
+        static_assert(AbsWeightSum(K) * UINT8_MAX <= INT16_MAX, "8-bit sums must fit in 16 bits");
+        size_t channels = BytesPerPixel(image.Format());
+        size_t count = image.Width() * channels;
+        ConvolveBands<uint8_t>(image, ROWS, COLS, [count, channels](const WindowRows<uint8_t> &rows, uint8_t *dst) {
+            ConvolveFixedRow<K>(rows, dst, count, channels, int16_t{UINT8_MAX}, std::make_index_sequence<ROWS * COLS>());
+        });
+        return;
+    }
+    size_t count = image.Width() * CHANNELS;
+    ConvolveBands<float>(image, ROWS, COLS, [count](const WindowRows<float> &rows, float *dst) {
+        ConvolveFixedRow<K>(rows, dst, count, CHANNELS, 1.0f, std::make_index_sequence<ROWS * COLS>());
+    });
+}
+
+template void ConvolveFixed<SHARPENING_KERNEL>(Image &image);
+template void ConvolveFixed<EDGE_DETECTION_KERNEL>(Image &image);
+
+template <size_t Rows, size_t Cols>
+bool SameWeights(const ConvKernel &kernel, const Kernel<Rows, Cols> &fixed) {
+    if (kernel.rows != Rows || kernel.cols != Cols) {
+        return false;
+    }
+    for (size_t i = 0; i < Rows; ++i) {
+        for (size_t j = 0; j < Cols; ++j) {
+            if (kernel.weights[i * Cols + j] != fixed.weights[i][j]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void Convolve(Image &image, const ConvKernel &kernel) {
+    if (SameWeights(kernel, SHARPENING_KERNEL)) {
+        ConvolveFixed<SHARPENING_KERNEL>(image);
+        return;
+    }
+    if (SameWeights(kernel, EDGE_DETECTION_KERNEL)) {
+        ConvolveFixed<EDGE_DETECTION_KERNEL>(image);
+        return;
+    }
+    if (image.Empty() || kernel.weights.empty()) {
+        return;
+    }
+    size_t padded = (image.Width() + 2 * (kernel.cols / 2)) * CHANNELS;
+    size_t count = image.Width() * CHANNELS;
+    ConvolveBands<float>(image, kernel.rows, kernel.cols, [&](const WindowRows<float> &rows, float *dst) {
+        thread_local std::vector<float> vertical;
+        thread_local std::vector<float> out;
+        out.assign(count, 0.0f);
+        if (kernel.separable) {
+            vertical.assign(padded, 0.0f);
+            for (size_t di = 0; di < kernel.rows; ++di) {
+                if (kernel.column[di] != 0) {
+                    AddScaled(vertical.data(), rows[di], kernel.column[di], padded);
+                }
+            }
+            for (size_t dj = 0; dj < kernel.cols; ++dj) {
+                if (kernel.row[dj] != 0) {
+                    AddScaled(out.data(), vertical.data() + dj * CHANNELS, kernel.row[dj], count);
+                }
+            }
+        } else {
+            for (size_t di = 0; di < kernel.rows; ++di) {
+                for (size_t dj = 0; dj < kernel.cols; ++dj) {
+                    float weight = kernel.weights[di * kernel.cols + dj];
+                    if (weight != 0) {
+                        AddScaled(out.data(), rows[di] + dj * CHANNELS, weight, count);
+                    }
+                }
+            }
+        }
+        for (size_t k = 0; k < count; ++k) {
+            dst[k] = std::clamp(out[k], 0.0f, 1.0f);
+        }
+    });
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <vector>
+#include "../graphics/graphics.h"
+#include "../graphics/image.h"
+
+// Kernel whose weights are known at compile time, so its convolution can be fully unrolled.
+template <size_t Rows, size_t Cols>
+struct Kernel {
+    static_assert(Rows % 2 == 1 && Cols % 2 == 1, "kernel sides must be odd");
+
+    std::array<std::array<float, Cols>, Rows> weights;
+
+    Matrix ToMatrix() const {
+        Matrix res(Rows, Cols);
+        for (size_t i = 0; i < Rows; ++i) {
+            for (size_t j = 0; j < Cols; ++j) {
+                res[i][j] = weights[i][j];
+            }
+        }
+        return res;
+    }
+};
+
+inline constexpr Kernel<3, 3> SHARPENING_KERNEL = {{{{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}}}};
+inline constexpr Kernel<3, 3> EDGE_DETECTION_KERNEL = {{{{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}}}};
+
+// Kernel with odd sides and weights stored row by row. Kernels of rank one also keep their column and
+// row factors, since two 1D passes are cheaper than the full 2D sum.
+struct ConvKernel {
+    explicit ConvKernel(const Matrix &matrix);
+
+    size_t rows = 0;
+    size_t cols = 0;
+    std::vector<float> weights;
+    bool separable = false;
+    std::vector<float> column;
+    std::vector<float> row;
+};
+
+// Convolves a float image in place. Pixels outside the image repeat the nearest edge pixel and the
+// result is clamped to [0, 1]. Every band of rows keeps a rolling window of padded source rows, so
+// the image is never copied as a whole. Kernels equal to one of the constexpr kernels above run
+// through the unrolled code of ConvolveFixed.
+void Convolve(Image &image, const ConvKernel &kernel);
+
+// Works on images of any format; 8-bit ones are convolved in integers. Instantiated for
+// SHARPENING_KERNEL and EDGE_DETECTION_KERNEL.
+template <const auto &K>
+void ConvolveFixed(Image &image);
@@ -1,10 +1,17 @@
 #include <iostream>
 
 const std::string INVALID_OPTIONS = "invalid options";
+const std::string INVALID_EXPRESSION = "invalid expression";
 const std::string HEADER_NAME = "header name is not BitMapInfoHeader";
 const std::string BIT_COUNT = "unsupported BMP bit count";
 const std::string COMPRESSION = "unsupported BMP compression";
 const std::string FILE_FORMAT = "wrong file format";
+const std::string TRUNCATED_FILE = "unexpected end of BMP file";
+const std::string UNSUPPORTED_CONVERSION = "cannot convert a color image to grayscale";
+const std::string MAPPING_FAILED = "cannot map file into memory";
+const std::string CACHE_ENTRY = "corrupt cache entry";
+const std::string INVALID_CACHE_DIR = "cannot write to the cache directory";
+const std::string SOCKET_FAILED = "cannot listen on the socket";
 const std::string EMPTY_OPTIONS = "empty options";
 const std::string EMPTY_OUTPUT_FILE = "empty output file";
 const std::string INVALID_OUTPUT_FILE = "invalid output file";
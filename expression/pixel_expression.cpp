@@ -0,0 +1,220 @@
+#include <cctype>
+#include <cstdlib>
+#include "pixel_expression.h"
+#include "../exceptions/exceptions.h"
+
+const std::string EXPR_VARIABLE_NAMES = "rgbxywh";
+
+// Recursive descent over the text, emitting an instruction for every operation as soon as both of its
+// operands are known. Slots are reused once their value is consumed, and operations on constants only
+// are folded right away.
+class PixelExpression::Compiler {
+public:
+    Compiler(const std::string &text, PixelExpression &res) : text_(text), res_(res) {
+    }
+
+    void Compile() {
+        Operand result = Comparison();
+        SkipSpaces();
+        if (pos_ != text_.size()) {
+            throw OptionExceptions(INVALID_EXPRESSION);
+        }
+        if (result.kind != Operand::Kind::SLOT) {
+            result = Emit(RowOp::COPY, result);
+        }
+        res_.result_ = result.index;
+    }
+
+private:
+    Operand Comparison() {
+        Operand left = Sum();
+        if (Accept('<')) {
+            return Emit(RowOp::LESS, left, Sum());
+        }
+        if (Accept('>')) {
+            return Emit(RowOp::GREATER, left, Sum());
+        }
+        return left;
+    }
+
+    Operand Sum() {
+        Operand left = Product();
+        while (true) {
+            if (Accept('+')) {
+                left = Emit(RowOp::ADD, left, Product());
+            } else if (Accept('-')) {
+                left = Emit(RowOp::SUB, left, Product());
+            } else {
+                return left;
+            }
+        }
+    }
+
+    Operand Product() {
+        Operand left = Unary();
+        while (true) {
+            if (Accept('*')) {
+                left = Emit(RowOp::MUL, left, Unary());
+            } else if (Accept('/')) {
+                left = Emit(RowOp::DIV, left, Unary());
+            } else {
+                return left;
+            }
+        }
+    }
+
+    Operand Unary() {
+        if (Accept('-')) {
+            return Emit(RowOp::NEG, Unary());
+        }
+        if (Accept('+')) {
+            return Unary();
+        }
+        return Primary();
+    }
+
+    Operand Primary() {
+        SkipSpaces();
+        if (Accept('(')) {
+            Operand res = Comparison();
+            Expect(')');
+            return res;
+        }
+        if (pos_ < text_.size() && (std::isdigit(static_cast<unsigned char>(text_[pos_])) || text_[pos_] == '.')) {
+            const char *begin = text_.c_str() + pos_;
+            char *end = nullptr;
+            float value = std::strtof(begin, &end);
+            if (end == begin) {
+                throw OptionExceptions(INVALID_EXPRESSION);
+            }
+            pos_ += end - begin;
+            return {Operand::Kind::CONSTANT, 0, value};
+        }
+        std::string name;
+        while (pos_ < text_.size() && std::isalpha(static_cast<unsigned char>(text_[pos_]))) {
+            name += text_[pos_++];
+        }
+        if (name.empty()) {
+            throw OptionExceptions(INVALID_EXPRESSION);
+        }
+        SkipSpaces();
+        if (pos_ < text_.size() && text_[pos_] == '(') {
+            return Call(name);
+        }
+        size_t index = EXPR_VARIABLE_NAMES.find(name);
+        if (name.size() != 1 || index == std::string::npos) {
+            throw OptionExceptions(INVALID_EXPRESSION);
+        }
+        res_.used_ |= 1u << index;
+        return {Operand::Kind::VARIABLE, index, 0};
+    }
+
+    Operand Call(const std::string &name) {
+        Expect('(');
+        std::vector<Operand> args = {Comparison()};
+        while (Accept(',')) {
+            args.push_back(Comparison());
+        }
+        Expect(')');
+        if (name == "abs" && args.size() == 1) {
+            return Emit(RowOp::ABS, args[0]);
+        }
+        if (name == "sqrt" && args.size() == 1) {
+            return Emit(RowOp::SQRT, args[0]);
+        }
+        if (name == "min" && args.size() == 2) {
+            return Emit(RowOp::MIN, args[0], args[1]);
+        }
+        if (name == "max" && args.size() == 2) {
+            return Emit(RowOp::MAX, args[0], args[1]);
+        }
+        if (name == "clamp" && args.size() == 3) {
+            return Emit(RowOp::MIN, Emit(RowOp::MAX, args[0], args[1]), args[2]);
+        }
+        throw OptionExceptions(INVALID_EXPRESSION);
+    }
+
+    Operand Emit(RowOp op, Operand a, Operand b = {Operand::Kind::CONSTANT, 0, 0}) {
+        if (a.kind == Operand::Kind::CONSTANT && b.kind == Operand::Kind::CONSTANT) {
+            float value = 0;
+            RowOpF32(op, &value, {nullptr, a.value}, {nullptr, b.value}, 1);
+            return {Operand::Kind::CONSTANT, 0, value};
+        }
+        Release(a);
+        Release(b);
+        size_t dst = Allocate();
+        res_.code_.push_back({op, a, b, dst});
+        return {Operand::Kind::SLOT, dst, 0};
+    }
+
+    size_t Allocate() {
+        if (free_slots_.empty()) {
+            return res_.slots_++;
+        }
+        size_t slot = free_slots_.back();
+        free_slots_.pop_back();
+        return slot;
+    }
+
+    void Release(const Operand &operand) {
+        if (operand.kind == Operand::Kind::SLOT) {
+            free_slots_.push_back(operand.index);
+        }
+    }
+
+    void SkipSpaces() {
+        while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+            ++pos_;
+        }
+    }
+
+    bool Accept(char c) {
+        SkipSpaces();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void Expect(char c) {
+        if (!Accept(c)) {
+            throw OptionExceptions(INVALID_EXPRESSION);
+        }
+    }
+
+    const std::string &text_;
+    PixelExpression &res_;
+    size_t pos_ = 0;
+    std::vector<size_t> free_slots_;
+};
+
+PixelExpression::PixelExpression(const std::string &text) {
+    Compiler(text, *this).Compile();
+}
+
+bool PixelExpression::Uses(ExprVariable variable) const {
+    return (used_ >> static_cast<size_t>(variable)) & 1;
+}
+
+const float *PixelExpression::Evaluate(const float *const rows[], const float values[], float *slots,
+                                       size_t width) const {
+    auto resolve = [&](const Operand &operand) -> RowOperand {
+        switch (operand.kind) {
+            case Operand::Kind::SLOT:
+                return {slots + operand.index * width, 0};
+            case Operand::Kind::VARIABLE:
+                if (operand.index < ROW_VARIABLES) {
+                    return {rows[operand.index], 0};
+                }
+                return {nullptr, values[operand.index - ROW_VARIABLES]};
+            default:
+                return {nullptr, operand.value};
+        }
+    };
+    for (const auto &instruction : code_) {
+        RowOpF32(instruction.op, slots + instruction.dst * width, resolve(instruction.a), resolve(instruction.b),
+                 width);
+    }
+    return slots + result_ * width;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../simd/kernels.h"
+
+// Variables of an expression: the channels in [0, 1], the column and row of the pixel and the size of
+// the image. The first ROW_VARIABLES change along a row, the others are the same for all of it.
+enum class ExprVariable { R, G, B, X, Y, W, H };
+
+const size_t ROW_VARIABLES = 4;
+
+// Arithmetic expression over ExprVariable compiled into register code. Every instruction processes
+// a whole row at once, so interpreting it costs once per row and the arithmetic runs in SIMD.
+//
+// Grammar: numbers, r g b x y w h, + - * / < > (comparisons give 0 or 1), unary minus, parentheses,
+// abs(a), sqrt(a), min(a, b), max(a, b) and clamp(a, lo, hi).
+class PixelExpression {
+public:
+    // Throws OptionExceptions if text is not a valid expression.
+    explicit PixelExpression(const std::string &text);
+
+    bool Uses(ExprVariable variable) const;
+    // Number of rows of scratch space Evaluate needs.
+    size_t Slots() const {
+        return slots_;
+    }
+    // rows are the R, G, B and X rows of width values, values are Y, W and H. slots holds Slots() rows
+    // of width values; returns the row of results, which is one of them.
+    const float *Evaluate(const float *const rows[], const float values[], float *slots, size_t width) const;
+
+private:
+    struct Operand {
+        enum class Kind { SLOT, VARIABLE, CONSTANT };
+        Kind kind;
+        size_t index;
+        float value;
+    };
+
+    struct Instruction {
+        RowOp op;
+        Operand a;
+        Operand b;
+        size_t dst;
+    };
+
+    class Compiler;
+
+    std::vector<Instruction> code_;
+    size_t slots_ = 0;
+    size_t result_ = 0;
+    uint32_t used_ = 0;
+};
@@ -1,14 +1,24 @@
+#include <algorithm>
+#include <iomanip>
 #include <sstream>
 #include <cmath>
 #include "filters.h"
+#include "gaussian_blur.h"
+#include "resize.h"
+#include "../convolution/convolution.h"
 #include "../exceptions/exceptions.h"
+#include "../parallel/thread_pool.h"
+#include "../simd/kernels.h"
 
-const double RED_COF = 0.299;
-const double GREEN_COF = 0.587;
-const double BLUE_COF = 0.114;
-const Matrix SHAPERING_MATRIX(3, 3, {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}});
-const Matrix EDGE_DETECTION_MATRIX(3, 3, {{0, -1, 0}, {-1, 4, -1}, {0, -1, 0}});
-const int32_t SIGMA_BUBEN = 3;
+const Matrix SHAPERING_MATRIX = SHARPENING_KERNEL.ToMatrix();
+const Matrix EDGE_DETECTION_MATRIX = EDGE_DETECTION_KERNEL.ToMatrix();
+const float ANAGLYPH_COF = 2.3f;
+// 8-bit edge detection keeps the gray levels exact, in thousandths of a channel level.
+const int32_t EDGE_GRAY_SCALE = 1000;
+const int32_t EDGE_GRAY_RED = static_cast<int32_t>(std::lround(RED_COF * EDGE_GRAY_SCALE));
+const int32_t EDGE_GRAY_GREEN = static_cast<int32_t>(std::lround(GREEN_COF * EDGE_GRAY_SCALE));
+const int32_t EDGE_GRAY_BLUE = static_cast<int32_t>(std::lround(BLUE_COF * EDGE_GRAY_SCALE));
+const int32_t EDGE_GRAY_WHITE = EDGE_GRAY_SCALE * UINT8_MAX;
 
 Filter::Filter(const std::string &name, const std::string &help, size_t args_cnt)
     : name(name), help(help), args(std::vector<std::string>(args_cnt)) {
@@ -65,120 +75,546 @@ Anaglyph::Anaglyph(size_t args_cnt) : Filter("-anaglyph", "3d anaglyph", args_cn
 Anaglyph::Anaglyph(const Anaglyph &anaglyph) : Filter(anaglyph) {
 }
 
-void Crop::Apply(BMP &bmp) {
+Convolution::Convolution(size_t args_cnt) : Filter("-conv", "convolution with a custom kernel", args_cnt) {
+}
+
+Convolution::Convolution(const Convolution &convolution) : Filter(convolution) {
+}
+
+Expression::Expression(size_t args_cnt)
+    : Filter("-expr", "per-channel expressions over r, g, b, x, y, w, h", args_cnt) {
+}
+
+Expression::Expression(const Expression &expression)
+    : Filter(expression), channels_(expression.channels_), pixel_size_(expression.pixel_size_) {
+}
+
+Resize::Resize(size_t args_cnt) : Filter("-resize", "scale the image to the given size", args_cnt) {
+}
+
+Resize::Resize(const Resize &resize) : Filter(resize) {
+}
+
+MatrixFilter::MatrixFilter(const Matrix &matrix)
+    : Filter("-matrix", "convolution with a fixed matrix", 0), matrix_(matrix) {
+}
+
+MatrixFilter::MatrixFilter(const MatrixFilter &matrix_filter) : Filter(matrix_filter), matrix_(matrix_filter.matrix_) {
+}
+
+Threshold::Threshold(size_t args_cnt) : Filter("-threshold", "black and white by the red channel", args_cnt) {
+}
+
+Threshold::Threshold(const Threshold &threshold) : Filter(threshold) {
+}
+
+FusedPointwise::FusedPointwise(const std::vector<PointOp> &ops)
+    : Filter("-fused", "several per-pixel filters in one pass", 0), ops_(ops) {
+    for (const auto &op : ops_) {
+        if (op.IsAffine() && !float_steps_.empty() && float_steps_.back().IsAffine()) {
+            PointOp &last = float_steps_.back();
+            last.kind = PointOp::Kind::COLOR_MATRIX;
+            last.matrix = last.matrix.Then(op.matrix);
+        } else {
+            float_steps_.push_back(op);
+        }
+    }
+}
+
+FusedPointwise::FusedPointwise(const FusedPointwise &fused)
+    : Filter(fused), ops_(fused.ops_), float_steps_(fused.float_steps_) {
+}
+
+PointOp PointOp::GrayScale() {
+    return {Kind::GRAY_SCALE, ColorMatrix::GrayScale()};
+}
+
+PointOp PointOp::Negative() {
+    return {Kind::NEGATIVE, ColorMatrix::Negative()};
+}
+
+PointOp PointOp::Threshold(float threshold) {
+    return {Kind::THRESHOLD, ColorMatrix::Identity(), threshold};
+}
+
+bool PointOp::IsAffine() const {
+    return kind != Kind::THRESHOLD;
+}
+
+std::vector<std::unique_ptr<Filter>> Filter::Lower() const {
+    std::vector<std::unique_ptr<Filter>> res;
+    res.push_back(Clone());
+    return res;
+}
+
+// Numbers are printed back in full precision, so that "3" and "3.0" give the same key.
+void AppendKeyPart(std::ostringstream &key, const std::string &part) {
+    size_t parsed = 0;
+    double value = 0;
+    try {
+        value = std::stod(part, &parsed);
+    } catch (const std::exception &) {
+        parsed = 0;
+    }
+    key << ' ';
+    if (parsed == part.size()) {
+        key << value;
+    } else {
+        key << part;
+    }
+}
+
+std::string Filter::Key() const {
+    std::ostringstream key;
+    key << std::setprecision(std::numeric_limits<double>::max_digits10) << name;
+    for (const auto &arg : args) {
+        AppendKeyPart(key, arg);
+    }
+    return key.str();
+}
+
+void AppendMatrix(std::ostringstream &key, const ColorMatrix &matrix) {
+    for (const auto &row : matrix.weights) {
+        for (double weight : row) {
+            key << ' ' << weight;
+        }
+    }
+}
+
+std::string MatrixFilter::Key() const {
+    std::ostringstream key;
+    key << std::setprecision(std::numeric_limits<double>::max_digits10) << name << ' ' << matrix_.n << ' '
+        << matrix_.m;
+    for (const auto &row : matrix_.mat) {
+        for (double weight : row) {
+            key << ' ' << weight;
+        }
+    }
+    return key.str();
+}
+
+std::string FusedPointwise::Key() const {
+    std::ostringstream key;
+    key << std::setprecision(std::numeric_limits<double>::max_digits10) << name;
+    for (const auto &op : ops_) {
+        key << " [" << static_cast<int>(op.kind) << ' ' << op.threshold;
+        AppendMatrix(key, op.matrix);
+        key << ']';
+    }
+    return key.str();
+}
+
+size_t Crop::Width() const {
+    if (this->args.size() != 2) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    return std::stoul(args[0]);
+}
+
+size_t Crop::Height() const {
     if (this->args.size() != 2) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
-    uint32_t nwidth = std::stoul(args[0]);
-    uint32_t nheight = std::stoul(args[1]);
-    bmp.bmp_ih.bi_height = std::min(bmp.bmp_ih.bi_height, nheight);
-    bmp.bmp_ih.bi_width = std::min(bmp.bmp_ih.bi_width, nwidth);
+    return std::stoul(args[1]);
+}
+
+std::string ScaledSize(size_t size, double scale) {
+    double scaled = std::ceil(static_cast<double>(size) * scale);
+    return std::to_string(std::max<size_t>(1, static_cast<size_t>(scaled)));
+}
+
+std::unique_ptr<Filter> Crop::Scaled(double scale) const {
+    auto res = std::make_unique<Crop>(*this);
+    res->args = {ScaledSize(Width(), scale), ScaledSize(Height(), scale)};
+    return res;
+}
+
+void Crop::Apply(BMP &bmp) {
+    bmp.image.Crop(Width(), Height());
+    bmp.alpha.Crop(Width(), Height());
 }
 
 void GrayScale::Apply(BMP &bmp) {
     if (!this->args.empty()) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
-    for (size_t i = 0; i < bmp.bmp_ih.bi_height; ++i) {
-        for (size_t j = 0; j < bmp.bmp_ih.bi_width; ++j) {
-            double color =
-                RED_COF * bmp.data[i][j].red + GREEN_COF * bmp.data[i][j].green + BLUE_COF * bmp.data[i][j].blue;
-            bmp.data[i][j].red = color;
-            bmp.data[i][j].green = color;
-            bmp.data[i][j].blue = color;
-        }
+    if (bmp.image.Format() == PixelFormat::GRAY8) {
+        return;
     }
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (bmp.image.Format() == PixelFormat::BGR8) {
+                GrayScaleU8(bmp.image.Row<Pixel8>(i), bmp.image.Width());
+            } else {
+                GrayScaleF32(bmp.image.Row(i), bmp.image.Width());
+            }
+        }
+    });
 }
 
 void Negative::Apply(BMP &bmp) {
     if (!this->args.empty()) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
-    for (size_t i = 0; i < bmp.bmp_ih.bi_height; ++i) {
-        for (size_t j = 0; j < bmp.bmp_ih.bi_width; ++j) {
-            bmp.data[i][j].red = 1 - bmp.data[i][j].red;
-            bmp.data[i][j].green = 1 - bmp.data[i][j].green;
-            bmp.data[i][j].blue = 1 - bmp.data[i][j].blue;
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (bmp.image.Format() != PixelFormat::RGBF32) {
+                NegateU8(bmp.image.Row<uint8_t>(i), bmp.image.Width() * BytesPerPixel(bmp.image.Format()));
+            } else {
+                NegateF32(&bmp.image.Row(i)->red, bmp.image.Width() * sizeof(Pixel) / sizeof(float));
+            }
         }
+    });
+}
+
+std::vector<std::unique_ptr<Filter>> Sharpening::Lower() const {
+    if (!this->args.empty()) {
+        throw OptionExceptions(INVALID_OPTIONS);
     }
+    std::vector<std::unique_ptr<Filter>> res;
+    res.push_back(std::make_unique<MatrixFilter>(SHAPERING_MATRIX));
+    return res;
 }
 
 void Sharpening::Apply(BMP &bmp) {
     if (!this->args.empty()) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
+    if (bmp.image.Format() != PixelFormat::RGBF32) {
+        ConvolveFixed<SHARPENING_KERNEL>(bmp.image);
+        return;
+    }
     ApplyMatrixForBMP(bmp, SHAPERING_MATRIX);
 }
 
-void EdgeDetection::Apply(BMP &bmp) {
+std::vector<std::unique_ptr<Filter>> EdgeDetection::Lower() const {
     if (this->args.size() != 1) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
-    GrayScale gs(0);
-    gs.Apply(bmp);
-    ApplyMatrixForBMP(bmp, EDGE_DETECTION_MATRIX);
-    double threshold = std::stod(args[0]);
-    for (size_t i = 0; i < bmp.bmp_ih.bi_height; ++i) {
-        for (size_t j = 0; j < bmp.bmp_ih.bi_width; ++j) {
-            if (bmp.data[i][j].red > threshold) {
-                bmp.data[i][j] = Pixel::White();
+    std::vector<std::unique_ptr<Filter>> res;
+    res.push_back(std::make_unique<GrayScale>(0));
+    res.push_back(std::make_unique<MatrixFilter>(EDGE_DETECTION_MATRIX));
+    auto threshold = std::make_unique<Threshold>(1);
+    threshold->args[0] = args[0];
+    res.push_back(std::move(threshold));
+    return res;
+}
+
+// Grayscale, edge kernel and threshold in integers: the gray plane is not rounded to bytes, so only
+// pixels whose response is within float error of the threshold may differ from the float path.
+void DetectEdges8Bit(Image &image, float threshold) {
+    constexpr size_t SIDE = EDGE_DETECTION_KERNEL.weights.size();
+    constexpr size_t PAD = SIDE / 2;
+    size_t height = image.Height();
+    size_t width = image.Width();
+    size_t stride = width + 2 * PAD;
+    // Gray rows are padded by repeating the edge pixels, like the float convolution does.
+    std::vector<int32_t> gray(height * stride);
+    ParallelFor(0, height, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            int32_t *dst = gray.data() + i * stride + PAD;
+            if (image.Format() == PixelFormat::GRAY8) {
+                const uint8_t *row = image.Row<uint8_t>(i);
+                for (size_t j = 0; j < width; ++j) {
+                    dst[j] = EDGE_GRAY_SCALE * row[j];
+                }
             } else {
-                bmp.data[i][j] = Pixel::Black();
+                const Pixel8 *row = image.Row<Pixel8>(i);
+                for (size_t j = 0; j < width; ++j) {
+                    dst[j] = EDGE_GRAY_RED * row[j].red + EDGE_GRAY_GREEN * row[j].green + EDGE_GRAY_BLUE * row[j].blue;
+                }
+            }
+            std::fill(dst - PAD, dst, dst[0]);
+            std::fill(dst + width, dst + width + PAD, dst[width - 1]);
+        }
+    });
+    int32_t limit = static_cast<int32_t>(static_cast<double>(threshold) * EDGE_GRAY_WHITE);
+    ParallelFor(0, height, [&](size_t begin, size_t end) {
+        std::vector<uint8_t> colors(width);
+        for (size_t i = begin; i < end; ++i) {
+            const int32_t *rows[SIDE];
+            for (size_t di = 0; di < SIDE; ++di) {
+                size_t x = std::clamp<ptrdiff_t>(static_cast<ptrdiff_t>(i + di) - PAD, 0, height - 1);
+                rows[di] = gray.data() + x * stride;
+            }
+            uint8_t *__restrict out =
+                image.Format() == PixelFormat::GRAY8 ? image.Row<uint8_t>(i) : colors.data();
+            for (size_t j = 0; j < width; ++j) {
+                int32_t sum = 0;
+                for (size_t di = 0; di < SIDE; ++di) {
+                    for (size_t dj = 0; dj < SIDE; ++dj) {
+                        sum += static_cast<int32_t>(EDGE_DETECTION_KERNEL.weights[di][dj]) * rows[di][j + dj];
+                    }
+                }
+                out[j] = std::clamp(sum, 0, EDGE_GRAY_WHITE) > limit ? UINT8_MAX : 0;
+            }
+            if (image.Format() == PixelFormat::GRAY8) {
+                continue;
             }
+            Pixel8 *row = image.Row<Pixel8>(i);
+            for (size_t j = 0; j < width; ++j) {
+                row[j] = {colors[j], colors[j], colors[j]};
+            }
+        }
+    });
+}
+
+void EdgeDetection::Apply(BMP &bmp) {
+    if (bmp.image.Format() != PixelFormat::RGBF32) {
+        if (this->args.size() != 1) {
+            throw OptionExceptions(INVALID_OPTIONS);
         }
+        DetectEdges8Bit(bmp.image, std::stof(args[0]));
+        return;
+    }
+    for (const auto &stage : Lower()) {
+        stage->Apply(bmp);
     }
 }
 
-double Calc(double color, double sigma, int32_t len) {
-    return color / std::exp(static_cast<double>(len * len) / (2 * sigma * sigma));
+Matrix ParseKernel(const std::string &weights) {
+    std::vector<double> values;
+    std::stringstream ss(weights);
+    std::string value;
+    while (std::getline(ss, value, ',')) {
+        values.push_back(std::stod(value));
+    }
+    size_t side = static_cast<size_t>(std::round(std::sqrt(static_cast<double>(values.size()))));
+    if (side % 2 == 0 || side * side != values.size()) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    Matrix res(side, side);
+    for (size_t i = 0; i < side; ++i) {
+        for (size_t j = 0; j < side; ++j) {
+            res[i][j] = values[i * side + j];
+        }
+    }
+    return res;
 }
 
-void GaussianBlur::Apply(BMP &bmp) {
+std::vector<std::unique_ptr<Filter>> Convolution::Lower() const {
     if (this->args.size() != 1) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
-    double sigma = std::stod(args[0]);
-    const int32_t delta = static_cast<int32_t>(std::round(SIGMA_BUBEN * sigma));
-    std::vector<std::vector<Pixel>> tmp_data = bmp.data;
-
-    const double cof = (M_PI * 2 * sigma * sigma);
-    int32_t height = static_cast<int32_t>(bmp.bmp_ih.bi_height);
-    int32_t width = static_cast<int32_t>(bmp.bmp_ih.bi_width);
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            double red_res = 0;
-            double green_res = 0;
-            double blue_res = 0;
-            for (int32_t x = i - delta; x < i + delta; ++x) {
-                int32_t x_nearest = x;
-                RelaxToNearest(x_nearest, j, height, width);
-                red_res += Calc(bmp.data[x_nearest][j].red, sigma, x - i);
-                green_res += Calc(bmp.data[x_nearest][j].green, sigma, x - i);
-                blue_res += Calc(bmp.data[x_nearest][j].blue, sigma, x - i);
+    std::vector<std::unique_ptr<Filter>> res;
+    res.push_back(std::make_unique<MatrixFilter>(ParseKernel(args[0])));
+    return res;
+}
+
+void Convolution::Apply(BMP &bmp) {
+    for (const auto &stage : Lower()) {
+        stage->Apply(bmp);
+    }
+}
+
+// Expressions may contain spaces, so they are taken whole instead of being read word by word.
+size_t Expression::Parse(size_t argc, char *argv[], size_t i) {
+    if (i + args.size() > argc) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    channels_.clear();
+    for (size_t k = 0; k < args.size(); ++k) {
+        args[k] = argv[i + k];
+        channels_.emplace_back(args[k]);
+    }
+    return i + args.size();
+}
+
+bool Expression::Uses(ExprVariable variable) const {
+    return std::any_of(channels_.begin(), channels_.end(),
+                       [&](const PixelExpression &channel) { return channel.Uses(variable); });
+}
+
+Halo Expression::GetHalo() const {
+    return {Uses(ExprVariable::Y) || Uses(ExprVariable::H) ? UNBOUNDED : 0, Uses(ExprVariable::W) ? UNBOUNDED : 0};
+}
+
+std::unique_ptr<Filter> Expression::Scaled(double scale) const {
+    auto res = std::make_unique<Expression>(*this);
+    res->pixel_size_ /= scale;
+    return res;
+}
+
+void Expression::Apply(BMP &bmp) {
+    if (channels_.size() != 3) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    bmp.image.ConvertTo(PixelFormat::RGBF32);
+    size_t width = bmp.image.Width();
+    size_t slots = 0;
+    for (const auto &channel : channels_) {
+        slots += channel.Slots();
+    }
+    float pixel_size = static_cast<float>(pixel_size_);
+    float image_width = static_cast<float>(width) * pixel_size;
+    float image_height = static_cast<float>(bmp.image.Height()) * pixel_size;
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        // Rows of the variables that change along a row, the clamped results, then the slots of every channel.
+        std::vector<float> scratch((ROW_VARIABLES + 3 + slots) * width);
+        float *red = scratch.data();
+        float *green = red + width;
+        float *blue = green + width;
+        float *column = blue + width;
+        float *clamped = column + width;
+        for (size_t j = 0; j < width; ++j) {
+            column[j] = static_cast<float>(j) * pixel_size;
+        }
+        const float *rows[] = {red, green, blue, column};
+        for (size_t i = begin; i < end; ++i) {
+            Pixel *row = bmp.image.Row(i);
+            SplitChannelsF32(row, width, red, green, blue);
+            const float values[] = {static_cast<float>(i) * pixel_size, image_width, image_height};
+            float *channel_slots = clamped + 3 * width;
+            for (size_t k = 0; k < 3; ++k) {
+                const float *result = channels_[k].Evaluate(rows, values, channel_slots, width);
+                channel_slots += channels_[k].Slots() * width;
+                // Max goes first so that NaN becomes 0; the result may be one of the channel rows.
+                float *channel = clamped + k * width;
+                RowOpF32(RowOp::MAX, channel, {result, 0.0f}, {nullptr, 0.0f}, width);
+                RowOpF32(RowOp::MIN, channel, {channel, 0.0f}, {nullptr, 1.0f}, width);
             }
-            tmp_data[i][j].red = red_res;
-            tmp_data[i][j].green = green_res;
-            tmp_data[i][j].blue = blue_res;
+            MergeChannelsF32(row, width, clamped, clamped + width, clamped + 2 * width);
         }
+    });
+}
+
+size_t Resize::Width() const {
+    if (this->args.size() != 2 || std::stoul(args[0]) == 0) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    return std::stoul(args[0]);
+}
+
+size_t Resize::Height() const {
+    if (this->args.size() != 2 || std::stoul(args[1]) == 0) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    return std::stoul(args[1]);
+}
+
+std::unique_ptr<Filter> Resize::Scaled(double scale) const {
+    auto res = std::make_unique<Resize>(*this);
+    res->args = {ScaledSize(Width(), scale), ScaledSize(Height(), scale)};
+    return res;
+}
+
+void Resize::Apply(BMP &bmp) {
+    size_t width = Width();
+    size_t height = Height();
+    if (bmp.image.Width() == width && bmp.image.Height() == height) {
+        return;
+    }
+    bmp.image = ResizeImage(bmp.image, width, height);
+    if (!bmp.alpha.Empty()) {
+        bmp.alpha = ResizeImage(bmp.alpha, width, height);
+    }
+}
+
+void MatrixFilter::Apply(BMP &bmp) {
+    ApplyMatrixForBMP(bmp, matrix_);
+}
+
+std::optional<PointOp> Threshold::AsPointOp() const {
+    if (this->args.size() != 1) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    return PointOp::Threshold(std::stof(args[0]));
+}
+
+void ApplyPointOp(const PointOp &op, Pixel *row, size_t width) {
+    switch (op.kind) {
+        case PointOp::Kind::GRAY_SCALE:
+            GrayScaleF32(row, width);
+            break;
+        case PointOp::Kind::NEGATIVE:
+            NegateF32(&row->red, width * sizeof(Pixel) / sizeof(float));
+            break;
+        case PointOp::Kind::THRESHOLD:
+            ThresholdF32(row, width, op.threshold);
+            break;
+        case PointOp::Kind::COLOR_MATRIX:
+            ColorMatrixF32(row, width, op.matrix);
+            break;
+    }
+}
+
+void ApplyPointOp(const PointOp &op, Pixel8 *row, size_t width) {
+    if (op.kind == PointOp::Kind::GRAY_SCALE) {
+        GrayScaleU8(row, width);
+    } else {
+        NegateU8(&row->blue, width * sizeof(Pixel8));
     }
+}
+
+// Row of a GRAY8 image, which grayscale leaves as it is.
+void ApplyPointOp(const PointOp &op, uint8_t *row, size_t width) {
+    if (op.kind == PointOp::Kind::NEGATIVE) {
+        NegateU8(row, width);
+    }
+}
+
+void Threshold::Apply(BMP &bmp) {
+    PointOp op = *AsPointOp();
+    bmp.image.ConvertTo(PixelFormat::RGBF32);
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            ApplyPointOp(op, bmp.image.Row(i), bmp.image.Width());
+        }
+    });
+}
+
+bool FusedPointwise::Supports8Bit() const {
+    return std::all_of(ops_.begin(), ops_.end(), [](const PointOp &op) {
+        return op.kind == PointOp::Kind::GRAY_SCALE || op.kind == PointOp::Kind::NEGATIVE;
+    });
+}
 
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            double red_res = 0;
-            double green_res = 0;
-            double blue_res = 0;
-            for (int32_t y = j - delta; y < j + delta; ++y) {
-                int32_t y_nearest = y;
-                RelaxToNearest(i, y_nearest, height, width);
-                red_res += Calc(tmp_data[i][y_nearest].red, sigma, y - j);
-                green_res += Calc(tmp_data[i][y_nearest].green, sigma, y - j);
-                blue_res += Calc(tmp_data[i][y_nearest].blue, sigma, y - j);
+void FusedPointwise::Apply(BMP &bmp) {
+    if (!Supports8Bit()) {
+        bmp.image.ConvertTo(PixelFormat::RGBF32);
+    }
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (bmp.image.Format() == PixelFormat::GRAY8) {
+                for (const auto &op : ops_) {
+                    ApplyPointOp(op, bmp.image.Row<uint8_t>(i), bmp.image.Width());
+                }
+            } else if (bmp.image.Format() == PixelFormat::BGR8) {
+                for (const auto &op : ops_) {
+                    ApplyPointOp(op, bmp.image.Row<Pixel8>(i), bmp.image.Width());
+                }
+            } else {
+                for (const auto &op : float_steps_) {
+                    ApplyPointOp(op, bmp.image.Row(i), bmp.image.Width());
+                }
             }
-            bmp.data[i][j].red = red_res / cof;
-            bmp.data[i][j].green = green_res / cof;
-            bmp.data[i][j].blue = blue_res / cof;
         }
+    });
+}
+
+Halo GaussianBlur::GetHalo() const {
+    if (this->args.size() != 1) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    size_t reach = BlurReach(std::stod(args[0]));
+    return {reach, reach};
+}
+
+std::unique_ptr<Filter> GaussianBlur::Scaled(double scale) const {
+    if (this->args.size() != 1) {
+        throw OptionExceptions(INVALID_OPTIONS);
     }
+    auto res = std::make_unique<GaussianBlur>(*this);
+    res->args[0] = std::to_string(std::stod(args[0]) * scale);
+    return res;
+}
+
+void GaussianBlur::Apply(BMP &bmp) {
+    if (this->args.size() != 1) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    bmp.image.ConvertTo(PixelFormat::RGBF32);
+    BlurImage(bmp.image, std::stod(args[0]));
 }
 
 size_t Filter::Parse(size_t argc, char *argv[], size_t i) {
@@ -192,44 +628,36 @@ size_t Filter::Parse(size_t argc, char *argv[], size_t i) {
     return i + args.size();
 }
 
+// Every red value is mixed with the one step pixels to the left and every blue value with the one step
+// pixels to the right, weighted by ANAGLYPH_COF; values without such a neighbour are kept.
 void Anaglyph::Apply(BMP &bmp) {
     if (this->args.size() != 1) {
         throw OptionExceptions(INVALID_OPTIONS);
     }
     double offset = std::stod(args[0]);
-    int32_t height = static_cast<int32_t>(bmp.bmp_ih.bi_height);
-    int32_t width = static_cast<int32_t>(bmp.bmp_ih.bi_width);
-    int32_t step = std::floor(offset * width);
-    std::vector<std::vector<Pixel>> tmp_data = bmp.data;
-    std::vector<std::vector<double>> cnt_red(height, std::vector<double>(width, 1));
-    std::vector<std::vector<double>> cnt_green(height, std::vector<double>(width, 1));
-    std::vector<std::vector<double>> cnt_blue(height, std::vector<double>(width, 1));
-    const double cof = 2.3;
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            if (j + step < width) {
-                tmp_data[i][j + step].red += cof * bmp.data[i][j].red;
-                cnt_red[i][j + step] += cof;
-            } else {
-                tmp_data[i][width - j - 1].red += bmp.data[i][width - j - 1].red;
-                cnt_red[i][width - j - 1]++;
-            }
-            if (j - step >= 0) {
-                tmp_data[i][j - step].blue += cof * bmp.data[i][j].blue;
-                cnt_blue[i][j - step] += cof;
-            } else {
-                tmp_data[i][width - j - 1].blue += bmp.data[i][width - j - 1].blue;
-                cnt_blue[i][width - j - 1]++;
-            }
+    bmp.image.ConvertTo(PixelFormat::RGBF32);
+    size_t width = bmp.image.Width();
+    double shift = std::floor(offset * static_cast<double>(width));
+    size_t step = std::min(width, static_cast<size_t>(std::max(0.0, shift)));
+    size_t mixed = width - step;
+    ParallelFor(0, bmp.image.Height(), [&](size_t begin, size_t end) {
+        // Channel planes of the row and the mixed red and blue ones.
+        std::vector<float> scratch(5 * width);
+        float *red = scratch.data();
+        float *green = red + width;
+        float *blue = green + width;
+        float *new_red = blue + width;
+        float *new_blue = new_red + width;
+        for (size_t i = begin; i < end; ++i) {
+            Pixel *row = bmp.image.Row(i);
+            SplitChannelsF32(row, width, red, green, blue);
+            std::copy(red, red + step, new_red);
+            MixF32(new_red + step, red + step, red, mixed, ANAGLYPH_COF);
+            MixF32(new_blue, blue, blue + step, mixed, ANAGLYPH_COF);
+            std::copy(blue + mixed, blue + width, new_blue + mixed);
+            MergeChannelsF32(row, width, new_red, green, new_blue);
         }
-    }
-    for (size_t i = 0; i < height; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-            bmp.data[i][j].red = tmp_data[i][j].red / cnt_red[i][j];
-            bmp.data[i][j].green = tmp_data[i][j].green / cnt_green[i][j];
-            bmp.data[i][j].blue = tmp_data[i][j].blue / cnt_blue[i][j];
-        }
-    }
+    });
 }
 
 std::string FilterController::GenerateWindow() {
@@ -240,7 +668,7 @@ std::string FilterController::GenerateWindow() {
     return res;
 }
 
-const std::unique_ptr<Filter> &FilterController::GiveFilterPattern(const std::string &name) {
+const std::unique_ptr<Filter> &FilterController::GiveFilterPattern(const std::string &name) const {
     for (const auto &f : filter_options_) {
         if (f->name == name) {
             return f;
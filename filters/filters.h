@@ -1,8 +1,32 @@
 #pragma once
+#include <limits>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 #include "../bmp/bmp.h"
+#include "../expression/pixel_expression.h"
+
+// Per-pixel operation a filter boils down to, so consecutive ones can be run in a single pass.
+struct PointOp {
+    enum class Kind { GRAY_SCALE, NEGATIVE, THRESHOLD, COLOR_MATRIX };
+    Kind kind;
+    ColorMatrix matrix;
+    float threshold = 0;
+
+    static PointOp GrayScale();
+    static PointOp Negative();
+    static PointOp Threshold(float threshold);
+    bool IsAffine() const;
+};
+
+// How far beyond the pixels it produces a stage reads, in rows and columns.
+struct Halo {
+    size_t rows;
+    size_t cols;
+};
+
+const size_t UNBOUNDED = std::numeric_limits<size_t>::max();
 
 class Filter {
 public:
@@ -12,10 +36,30 @@ public:
     Filter(const std::string &name, const std::string &help, size_t args_cnt);
     Filter(const std::string &name, const std::string &help, std::vector<std::string> &args);
     Filter(const Filter &oth);
-    size_t Parse(size_t argc, char *argv[], size_t i);
+    virtual size_t Parse(size_t argc, char *argv[], size_t i);
     virtual ~Filter() = default;
     virtual void Apply(BMP &bmp) = 0;
     virtual std::unique_ptr<Filter> Clone() const = 0;
+    // Whether Apply can work on 8-bit (BGR8 and GRAY8) images without converting them to float.
+    virtual bool Supports8Bit() const {
+        return false;
+    }
+    // Per-pixel operation equal to Apply, if the filter is one.
+    virtual std::optional<PointOp> AsPointOp() const {
+        return std::nullopt;
+    }
+    // Splits the filter into simpler stages for the pipeline planner.
+    virtual std::vector<std::unique_ptr<Filter>> Lower() const;
+    // UNBOUNDED means the stage needs the whole image along that axis.
+    virtual Halo GetHalo() const {
+        return {UNBOUNDED, UNBOUNDED};
+    }
+    // Copy of the filter for the image scaled by scale, with sizes given in pixels scaled along.
+    virtual std::unique_ptr<Filter> Scaled(double /*scale*/) const {
+        return Clone();
+    }
+    // Name and arguments in one string; filters that give the same key produce the same result.
+    virtual std::string Key() const;
 };
 
 class Crop : public Filter {
@@ -27,6 +71,15 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<Crop>(*this);
     }
+    size_t Width() const;
+    size_t Height() const;
+    Halo GetHalo() const override {
+        return {0, 0};
+    }
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::unique_ptr<Filter> Scaled(double scale) const override;
 };
 
 class GrayScale : public Filter {
@@ -38,6 +91,15 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<GrayScale>(*this);
     }
+    Halo GetHalo() const override {
+        return {0, 0};
+    }
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::optional<PointOp> AsPointOp() const override {
+        return PointOp::GrayScale();
+    }
 };
 
 class Negative : public Filter {
@@ -49,6 +111,15 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<Negative>(*this);
     }
+    Halo GetHalo() const override {
+        return {0, 0};
+    }
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::optional<PointOp> AsPointOp() const override {
+        return PointOp::Negative();
+    }
 };
 
 class Sharpening : public Filter {
@@ -60,6 +131,13 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<Sharpening>(*this);
     }
+    Halo GetHalo() const override {
+        return {1, 1};
+    }
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::vector<std::unique_ptr<Filter>> Lower() const override;
 };
 
 class EdgeDetection : public Filter {
@@ -71,6 +149,13 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<EdgeDetection>(*this);
     }
+    Halo GetHalo() const override {
+        return {1, 1};
+    }
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::vector<std::unique_ptr<Filter>> Lower() const override;
 };
 
 class GaussianBlur : public Filter {
@@ -82,6 +167,8 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<GaussianBlur>(*this);
     }
+    Halo GetHalo() const override;
+    std::unique_ptr<Filter> Scaled(double scale) const override;
 };
 
 class Anaglyph : public Filter {
@@ -93,6 +180,120 @@ public:
     std::unique_ptr<Filter> Clone() const override {
         return std::make_unique<Anaglyph>(*this);
     }
+    Halo GetHalo() const override {
+        return {0, UNBOUNDED};
+    }
+};
+
+// Convolution with a user kernel: an odd square of comma-separated weights listed row by row.
+class Convolution : public Filter {
+public:
+    explicit Convolution(size_t args_cnt);
+    Convolution(const Convolution &convolution);
+    ~Convolution() override = default;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<Convolution>(*this);
+    }
+    std::vector<std::unique_ptr<Filter>> Lower() const override;
+};
+
+// Per-pixel arithmetic given as one expression per channel, compiled when parsed.
+class Expression : public Filter {
+public:
+    explicit Expression(size_t args_cnt);
+    Expression(const Expression &expression);
+    ~Expression() override = default;
+    size_t Parse(size_t argc, char *argv[], size_t i) override;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<Expression>(*this);
+    }
+    // Pointwise, but y and the image size change when the image is cropped or split into bands.
+    Halo GetHalo() const override;
+    std::unique_ptr<Filter> Scaled(double scale) const override;
+
+private:
+    bool Uses(ExprVariable variable) const;
+
+    std::vector<PixelExpression> channels_;
+    // Size of a pixel in pixels of the full image, so x, y, w and h keep their values on -preview levels.
+    double pixel_size_ = 1;
+};
+
+// Scales the image to width x height with ResizeImage; the alpha channel is scaled along.
+class Resize : public Filter {
+public:
+    explicit Resize(size_t args_cnt);
+    Resize(const Resize &resize);
+    ~Resize() override = default;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<Resize>(*this);
+    }
+    size_t Width() const;
+    size_t Height() const;
+    bool Supports8Bit() const override {
+        return true;
+    }
+    std::unique_ptr<Filter> Scaled(double scale) const override;
+};
+
+// Convolution with a fixed matrix; a stage of lowered filters.
+class MatrixFilter : public Filter {
+public:
+    explicit MatrixFilter(const Matrix &matrix);
+    MatrixFilter(const MatrixFilter &matrix_filter);
+    ~MatrixFilter() override = default;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<MatrixFilter>(*this);
+    }
+    Halo GetHalo() const override {
+        return {matrix_.n / 2, matrix_.m / 2};
+    }
+    std::string Key() const override;
+
+private:
+    Matrix matrix_;
+};
+
+// Paints pixels whose red channel exceeds the threshold white and the others black.
+class Threshold : public Filter {
+public:
+    explicit Threshold(size_t args_cnt);
+    Threshold(const Threshold &threshold);
+    ~Threshold() override = default;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<Threshold>(*this);
+    }
+    Halo GetHalo() const override {
+        return {0, 0};
+    }
+    std::optional<PointOp> AsPointOp() const override;
+};
+
+// Several per-pixel operations applied row by row in one sweep over the image.
+class FusedPointwise : public Filter {
+public:
+    explicit FusedPointwise(const std::vector<PointOp> &ops);
+    FusedPointwise(const FusedPointwise &fused);
+    ~FusedPointwise() override = default;
+    void Apply(BMP &bmp) override;
+    std::unique_ptr<Filter> Clone() const override {
+        return std::make_unique<FusedPointwise>(*this);
+    }
+    Halo GetHalo() const override {
+        return {0, 0};
+    }
+    bool Supports8Bit() const override;
+    std::string Key() const override;
+
+private:
+    std::vector<PointOp> ops_;
+    // Float path: runs of affine operations are collapsed into one matrix.
+    std::vector<PointOp> float_steps_;
 };
 
 class FilterController {
@@ -103,7 +304,7 @@ public:
         return *this;
     }
 
-    const std::unique_ptr<Filter> &GiveFilterPattern(const std::string &name);
+    const std::unique_ptr<Filter> &GiveFilterPattern(const std::string &name) const;
 
     std::string GenerateWindow();
 
@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "gaussian_blur.h"
+#include "../parallel/thread_pool.h"
+
+const double SIGMA_BUBEN = 3;
+const size_t BOX_PASSES = 5;
+const size_t CHANNELS = sizeof(Pixel) / sizeof(float);
+const size_t COLUMN_BAND = 256;
+
+int32_t BlurRadius(double sigma) {
+    return static_cast<int32_t>(std::round(SIGMA_BUBEN * sigma));
+}
+
+// Taps for offsets -radius .. radius - 1. Each axis is scaled by 1 / sqrt(2 pi sigma^2), so the two
+// passes together divide by the 2D Gaussian normalization, as the original per-tap formula did.
+std::vector<float> GaussianTaps(double sigma, int32_t radius) {
+    double norm = std::sqrt(2 * M_PI * sigma * sigma);
+    std::vector<float> taps;
+    for (int32_t d = -radius; d < radius; ++d) {
+        taps.push_back(static_cast<float>(std::exp(-static_cast<double>(d * d) / (2 * sigma * sigma)) / norm));
+    }
+    return taps;
+}
+
+float *Floats(Image &image, size_t i) {
+    return &image.Row(i)->red;
+}
+
+size_t Clamp(int64_t x, size_t size) {
+    return static_cast<size_t>(std::clamp<int64_t>(x, 0, static_cast<int64_t>(size) - 1));
+}
+
+void ConvolveColumns(Image &src, Image &dst, const std::vector<float> &taps, int32_t radius) {
+    size_t count = src.Width() * CHANNELS;
+    ParallelFor(0, src.Height(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            float *out = Floats(dst, i);
+            std::fill(out, out + count, 0.0f);
+            for (int32_t d = -radius; d < radius; ++d) {
+                const float *in = Floats(src, Clamp(static_cast<int64_t>(i) + d, src.Height()));
+                float w = taps[d + radius];
+                for (size_t k = 0; k < count; ++k) {
+                    out[k] += w * in[k];
+                }
+            }
+        }
+    });
+}
+
+// Copies a row into line with pad pixels repeated on both sides.
+void PadRow(const float *row, size_t width, size_t pad, std::vector<float> &line) {
+    line.resize((width + 2 * pad) * CHANNELS);
+    for (size_t j = 0; j < pad; ++j) {
+        std::copy(row, row + CHANNELS, line.begin() + j * CHANNELS);
+        std::copy(row + (width - 1) * CHANNELS, row + width * CHANNELS, line.begin() + (pad + width + j) * CHANNELS);
+    }
+    std::copy(row, row + width * CHANNELS, line.begin() + pad * CHANNELS);
+}
+
+void ConvolveRows(Image &src, Image &dst, const std::vector<float> &taps, int32_t radius) {
+    size_t width = src.Width();
+    ParallelFor(0, src.Height(), [&](size_t begin, size_t end) {
+        std::vector<float> line;
+        for (size_t i = begin; i < end; ++i) {
+            PadRow(Floats(src, i), width, radius, line);
+            float *out = Floats(dst, i);
+            std::fill(out, out + width * CHANNELS, 0.0f);
+            for (size_t t = 0; t < taps.size(); ++t) {
+                const float *in = line.data() + t * CHANNELS;
+                float w = taps[t];
+                for (size_t k = 0; k < width * CHANNELS; ++k) {
+                    out[k] += w * in[k];
+                }
+            }
+        }
+    });
+}
+
+// Variance of the truncated window, which is noticeably below sigma^2 since it is cut at 3 sigma.
+double TapsVariance(const std::vector<float> &taps, int32_t radius) {
+    double sum = 0;
+    double mean = 0;
+    for (size_t t = 0; t < taps.size(); ++t) {
+        sum += taps[t];
+        mean += taps[t] * (static_cast<double>(t) - radius);
+    }
+    mean /= sum;
+    double variance = 0;
+    for (size_t t = 0; t < taps.size(); ++t) {
+        double d = static_cast<double>(t) - radius - mean;
+        variance += taps[t] * d * d;
+    }
+    return variance / sum;
+}
+
+// Radii of BOX_PASSES boxes whose combined variance is as close to the given one as odd widths allow.
+std::vector<int32_t> BoxRadii(double variance) {
+    double n = BOX_PASSES;
+    int32_t lower = static_cast<int32_t>(std::floor(std::sqrt(12 * variance / n + 1)));
+    if (lower % 2 == 0) {
+        --lower;
+    }
+    int32_t upper = lower + 2;
+    double lower_passes = std::round((12 * variance - n * lower * lower - 4 * n * lower - 3 * n) / (-4 * lower - 4));
+    std::vector<int32_t> radii;
+    for (size_t k = 0; k < BOX_PASSES; ++k) {
+        radii.push_back(((static_cast<double>(k) < lower_passes ? lower : upper) - 1) / 2);
+    }
+    return radii;
+}
+
+// Runs box passes over a line of positions holding lanes interleaved floats each. The line comes padded
+// by the sum of the radii, and every pass eats its radius from both ends, so the borders see repeated
+// source pixels instead of repeated intermediate results. The result ends up in line.
+void BoxPasses(std::vector<float> &line, std::vector<float> &tmp, size_t lanes, const std::vector<int32_t> &radii) {
+    size_t len = line.size() / lanes;
+    std::vector<double> sum(lanes);
+    for (int32_t radius : radii) {
+        size_t window = 2 * radius + 1;
+        len -= 2 * radius;
+        tmp.resize(len * lanes);
+        std::fill(sum.begin(), sum.end(), 0);
+        for (size_t t = 0; t + 1 < window; ++t) {
+            for (size_t k = 0; k < lanes; ++k) {
+                sum[k] += line[t * lanes + k];
+            }
+        }
+        float scale = 1.0f / static_cast<float>(window);
+        for (size_t i = 0; i < len; ++i) {
+            const float *in = line.data() + (i + window - 1) * lanes;
+            const float *out_of_window = line.data() + i * lanes;
+            float *out = tmp.data() + i * lanes;
+            for (size_t k = 0; k < lanes; ++k) {
+                sum[k] += in[k];
+                out[k] = static_cast<float>(sum[k]) * scale;
+                sum[k] -= out_of_window[k];
+            }
+        }
+        line.swap(tmp);
+    }
+}
+
+void BoxRows(Image &image, const std::vector<int32_t> &radii, int32_t pad, float gain) {
+    size_t width = image.Width();
+    ParallelFor(0, image.Height(), [&](size_t begin, size_t end) {
+        std::vector<float> line;
+        std::vector<float> tmp;
+        for (size_t i = begin; i < end; ++i) {
+            float *row = Floats(image, i);
+            PadRow(row, width, pad, line);
+            BoxPasses(line, tmp, CHANNELS, radii);
+            for (size_t k = 0; k < width * CHANNELS; ++k) {
+                row[k] = line[k] * gain;
+            }
+        }
+    });
+}
+
+void BoxColumns(Image &image, const std::vector<int32_t> &radii, int32_t pad, float gain) {
+    size_t height = image.Height();
+    ParallelFor(
+        0, image.Width() * CHANNELS,
+        [&](size_t begin, size_t end) {
+            size_t lanes = end - begin;
+            std::vector<float> line((height + 2 * pad) * lanes);
+            std::vector<float> tmp;
+            for (int64_t x = -pad; x < static_cast<int64_t>(height) + pad; ++x) {
+                const float *in = Floats(image, Clamp(x, height)) + begin;
+                std::copy(in, in + lanes, line.begin() + (x + pad) * lanes);
+            }
+            BoxPasses(line, tmp, lanes, radii);
+            for (size_t i = 0; i < height; ++i) {
+                float *out = Floats(image, i) + begin;
+                for (size_t k = 0; k < lanes; ++k) {
+                    out[k] = line[i * lanes + k] * gain;
+                }
+            }
+        },
+        COLUMN_BAND);
+}
+
+int32_t BlurReach(double sigma) {
+    int32_t radius = std::max(BlurRadius(sigma), 0);
+    if (sigma < BOX_BLUR_MIN_SIGMA) {
+        return radius;
+    }
+    int32_t pad = 0;
+    for (int32_t r : BoxRadii(TapsVariance(GaussianTaps(sigma, radius), radius))) {
+        pad += r;
+    }
+    return std::max(radius, pad);
+}
+
+void BlurImage(Image &image, double sigma) {
+    int32_t radius = BlurRadius(sigma);
+    std::vector<float> taps = GaussianTaps(sigma, radius);
+    if (sigma < BOX_BLUR_MIN_SIGMA) {
+        Image tmp(image.Width(), image.Height(), PixelFormat::RGBF32);
+        ConvolveColumns(image, tmp, taps, radius);
+        ConvolveRows(tmp, image, taps, radius);
+        return;
+    }
+    // Boxes are normalized to 1; the truncated Gaussian window is not, so its gain is kept.
+    double gain = 0;
+    for (float w : taps) {
+        gain += w;
+    }
+    std::vector<int32_t> radii = BoxRadii(TapsVariance(taps, radius));
+    int32_t pad = 0;
+    for (int32_t r : radii) {
+        pad += r;
+    }
+    BoxColumns(image, radii, pad, static_cast<float>(gain));
+    BoxRows(image, radii, pad, static_cast<float>(gain));
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstdint>
+#include "../graphics/image.h"
+
+// Radius of the blur window; taps run from -radius to radius - 1 along each axis.
+int32_t BlurRadius(double sigma);
+
+// How far from a pixel BlurImage reads along each axis. It is BlurRadius for the direct kernel and
+// the sum of the box radii, which is a bit larger, for stacked boxes.
+int32_t BlurReach(double sigma);
+
+// Separable Gaussian blur with edge pixels repeated outside the image. Small sigmas are convolved
+// with a precomputed kernel; from BOX_BLUR_MIN_SIGMA on the Gaussian is approximated by stacked
+// box blurs built on running sums, whose cost per pixel does not depend on sigma.
+void BlurImage(Image &image, double sigma);
+
+const double BOX_BLUR_MIN_SIGMA = 6;
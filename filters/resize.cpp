@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "resize.h"
+#include "../parallel/thread_pool.h"
+#include "../simd/kernels.h"
+
+const double LANCZOS_LOBES = 3;
+const float MAX_LEVEL = 255;
+
+// Weights of one axis: result k is the sum of taps source values from first[k] on, weighted by
+// weights[k * taps ...]. Every result gets the same number of taps, padded with zero weights.
+struct AxisWeights {
+    size_t taps = 0;
+    std::vector<size_t> first;
+    std::vector<float> weights;
+};
+
+double Lanczos(double x) {
+    if (x == 0) {
+        return 1;
+    }
+    if (std::abs(x) >= LANCZOS_LOBES) {
+        return 0;
+    }
+    double px = M_PI * x;
+    return LANCZOS_LOBES * std::sin(px) * std::sin(px / LANCZOS_LOBES) / (px * px);
+}
+
+AxisWeights MakeAxisWeights(size_t src, size_t dst) {
+    double factor = static_cast<double>(src) / static_cast<double>(dst);
+    std::vector<size_t> lo(dst);
+    std::vector<std::vector<double>> dense(dst);
+    size_t taps = 0;
+    for (size_t k = 0; k < dst; ++k) {
+        std::vector<std::pair<size_t, double>> terms;
+        if (factor >= AREA_RESIZE_MIN_FACTOR) {
+            double begin = static_cast<double>(k) * factor;
+            double end = std::min(static_cast<double>(k + 1) * factor, static_cast<double>(src));
+            for (auto i = static_cast<size_t>(begin); static_cast<double>(i) < end; ++i) {
+                auto x = static_cast<double>(i);
+                terms.emplace_back(i, std::min(end, x + 1) - std::max(begin, x));
+            }
+        } else {
+            // Shrinking stretches the kernel, so it still covers every source pixel.
+            double scale = std::max(1.0, factor);
+            double center = (static_cast<double>(k) + 0.5) * factor - 0.5;
+            double radius = LANCZOS_LOBES * scale;
+            auto last = static_cast<int64_t>(std::floor(center + radius));
+            for (auto i = static_cast<int64_t>(std::ceil(center - radius)); i <= last; ++i) {
+                auto clamped = static_cast<size_t>(std::clamp<int64_t>(i, 0, static_cast<int64_t>(src) - 1));
+                terms.emplace_back(clamped, Lanczos((static_cast<double>(i) - center) / scale));
+            }
+        }
+        lo[k] = src;
+        size_t hi = 0;
+        double sum = 0;
+        for (const auto &[i, w] : terms) {
+            lo[k] = std::min(lo[k], i);
+            hi = std::max(hi, i);
+            sum += w;
+        }
+        dense[k].assign(hi - lo[k] + 1, 0);
+        for (const auto &[i, w] : terms) {
+            dense[k][i - lo[k]] += w / sum;
+        }
+        taps = std::max(taps, dense[k].size());
+    }
+
+    AxisWeights axis;
+    axis.taps = taps;
+    axis.first.resize(dst);
+    axis.weights.assign(dst * taps, 0);
+    for (size_t k = 0; k < dst; ++k) {
+        axis.first[k] = std::min(lo[k], src - taps);
+        for (size_t t = 0; t < dense[k].size(); ++t) {
+            axis.weights[k * taps + lo[k] - axis.first[k] + t] = static_cast<float>(dense[k][t]);
+        }
+    }
+    return axis;
+}
+
+void StoreRow(const float *sum, float *out, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        out[k] = std::min(std::max(sum[k], 0.0f), 1.0f);
+    }
+}
+
+void StoreRow(const float *sum, uint8_t *out, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        out[k] = static_cast<uint8_t>(std::clamp(sum[k], 0.0f, MAX_LEVEL) + 0.5f);
+    }
+}
+
+Image ResizeImage(const Image &image, size_t width, size_t height) {
+    PixelFormat format = image.Format();
+    size_t lanes = format == PixelFormat::GRAY8 ? 1 : sizeof(Pixel) / sizeof(float);
+    AxisWeights cols = MakeAxisWeights(image.Width(), width);
+    AxisWeights rows = MakeAxisWeights(image.Height(), height);
+    size_t src_count = image.Width() * lanes;
+    size_t count = width * lanes;
+
+    // Along rows first, into floats: every source row is read once and the pass along columns works on
+    // rows of the new width.
+    std::shared_ptr<uint8_t> buffer = BufferPool::Instance().Acquire(image.Height() * count * sizeof(float));
+    auto *tmp = reinterpret_cast<float *>(buffer.get());
+    ParallelFor(0, image.Height(), [&](size_t begin, size_t end) {
+        std::vector<float> line(format == PixelFormat::RGBF32 ? 0 : src_count);
+        for (size_t i = begin; i < end; ++i) {
+            const float *in = line.data();
+            if (format == PixelFormat::RGBF32) {
+                in = &image.Row(i)->red;
+            } else {
+                const uint8_t *row = image.Row<uint8_t>(i);
+                std::copy(row, row + src_count, line.begin());
+            }
+            ResampleRowF32(tmp + i * count, in, lanes, cols.first.data(), cols.weights.data(), cols.taps, width);
+        }
+    });
+
+    Image res(width, height, format);
+    ParallelFor(0, height, [&](size_t begin, size_t end) {
+        std::vector<float> sum(count);
+        for (size_t i = begin; i < end; ++i) {
+            std::fill(sum.begin(), sum.end(), 0.0f);
+            for (size_t t = 0; t < rows.taps; ++t) {
+                AccumulateF32(sum.data(), tmp + (rows.first[i] + t) * count, count, rows.weights[i * rows.taps + t]);
+            }
+            if (format == PixelFormat::RGBF32) {
+                StoreRow(sum.data(), &res.Row(i)->red, count);
+            } else {
+                StoreRow(sum.data(), res.Row<uint8_t>(i), count);
+            }
+        }
+    });
+    return res;
+}
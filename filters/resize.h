@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+#include "../graphics/image.h"
+
+// An axis shrunk at least this many times is area-averaged instead of Lanczos-filtered.
+const double AREA_RESIZE_MIN_FACTOR = 2;
+
+// Separable resampling to width x height in the format of image, with edge pixels repeated outside it.
+// Along an axis shrunk at least AREA_RESIZE_MIN_FACTOR times every result is the average of the source
+// area it covers; otherwise Lanczos-3 is used, widened by the reduction when shrinking, so both methods
+// are free of aliasing. The weights of every axis are computed once. Results are clamped to the range
+// of the format, so Lanczos overshoot at sharp edges does not wrap around.
+Image ResizeImage(const Image &image, size_t width, size_t height);
@@ -1,8 +1,8 @@
 #include "graphics.h"
 
-const double MAX_COLOR = 1;
+const float MAX_COLOR = 1;
 
-Pixel::Pixel(double red, double green, double blue) : red(red), green(green), blue(blue) {
+Pixel::Pixel(float red, float green, float blue) : red(red), green(green), blue(blue) {
 }
 
 Pixel Pixel::Red() {
@@ -25,6 +25,32 @@ Pixel Pixel::Black() {
     return Pixel(0, 0, 0);
 }
 
+ColorMatrix ColorMatrix::Identity() {
+    return {{{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}}};
+}
+
+ColorMatrix ColorMatrix::GrayScale() {
+    std::array<double, 4> gray = {RED_COF, GREEN_COF, BLUE_COF, 0};
+    return {{gray, gray, gray}};
+}
+
+ColorMatrix ColorMatrix::Negative() {
+    return {{{{-1, 0, 0, MAX_COLOR}, {0, -1, 0, MAX_COLOR}, {0, 0, -1, MAX_COLOR}}}};
+}
+
+ColorMatrix ColorMatrix::Then(const ColorMatrix &next) const {
+    ColorMatrix res = {};
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            for (size_t k = 0; k < 3; ++k) {
+                res.weights[i][j] += next.weights[i][k] * weights[k][j];
+            }
+        }
+        res.weights[i][3] += next.weights[i][3];
+    }
+    return res;
+}
+
 Matrix::Matrix(size_t n, size_t m, const std::vector<std::vector<double>> &mat) : n(n), m(m), mat(mat) {
 }
 
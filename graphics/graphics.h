@@ -1,15 +1,21 @@
 #pragma once
+#include <array>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 
+const double RED_COF = 0.299;
+const double GREEN_COF = 0.587;
+const double BLUE_COF = 0.114;
+
 class Pixel {
 public:
-    double red;
-    double green;
-    double blue;
+    float red;
+    float green;
+    float blue;
 
     Pixel() = default;
-    Pixel(double red, double green, double blue);
+    Pixel(float red, float green, float blue);
     ~Pixel() = default;
 
     static Pixel Red();
@@ -19,6 +25,27 @@ public:
     static Pixel Black();
 };
 
+// 8-bit pixel laid out in BMP byte order, so BMP rows can be used as is.
+struct Pixel8 {
+    uint8_t blue;
+    uint8_t green;
+    uint8_t red;
+};
+
+static_assert(sizeof(Pixel) == 3 * sizeof(float));
+static_assert(sizeof(Pixel8) == 3);
+
+// Affine color transform: every output channel is a weighted sum of red, green and blue plus a constant.
+struct ColorMatrix {
+    std::array<std::array<double, 4>, 3> weights;
+
+    static ColorMatrix Identity();
+    static ColorMatrix GrayScale();
+    static ColorMatrix Negative();
+    // Transform equal to applying this one and then next.
+    ColorMatrix Then(const ColorMatrix &next) const;
+};
+
 struct Matrix {
     size_t n;
     size_t m;
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "image.h"
+#include "../exceptions/exceptions.h"
+#include "../parallel/thread_pool.h"
+
+const size_t ROW_ALIGNMENT = 64;
+const size_t MAX_POOLED_BUFFERS = 16;
+const float MAX_CHANNEL = 255;
+
+size_t BytesPerPixel(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::BGR8:
+            return sizeof(Pixel8);
+        case PixelFormat::RGBF32:
+            return sizeof(Pixel);
+        case PixelFormat::GRAY8:
+            return sizeof(uint8_t);
+    }
+    return 0;
+}
+
+const std::array<float, 256> &ChannelTable() {
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> res{};
+        for (size_t i = 0; i < res.size(); ++i) {
+            res[i] = static_cast<float>(static_cast<double>(i) / MAX_CHANNEL);
+        }
+        return res;
+    }();
+    return table;
+}
+
+void UnpackBGR8Row(const Pixel8 *src, Pixel *dst, size_t width) {
+    const float *table = ChannelTable().data();
+    for (size_t j = 0; j < width; ++j) {
+        dst[j].red = table[src[j].red];
+        dst[j].green = table[src[j].green];
+        dst[j].blue = table[src[j].blue];
+    }
+}
+
+uint8_t PackChannel(float x) {
+    return static_cast<uint8_t>(MAX_CHANNEL * std::clamp(x, 0.0f, 1.0f) + 0.5f);
+}
+
+void PackBGR8Row(const Pixel *src, Pixel8 *dst, size_t width) {
+    for (size_t j = 0; j < width; ++j) {
+        dst[j].blue = PackChannel(src[j].blue);
+        dst[j].green = PackChannel(src[j].green);
+        dst[j].red = PackChannel(src[j].red);
+    }
+}
+
+void UnpackGray8Row(const uint8_t *src, Pixel *dst, size_t width) {
+    const float *table = ChannelTable().data();
+    for (size_t j = 0; j < width; ++j) {
+        float value = table[src[j]];
+        dst[j] = Pixel(value, value, value);
+    }
+}
+
+void ExpandGray8Row(const uint8_t *src, Pixel8 *dst, size_t width) {
+    for (size_t j = 0; j < width; ++j) {
+        dst[j] = {src[j], src[j], src[j]};
+    }
+}
+
+size_t AlignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+BufferPool &BufferPool::Instance() {
+    static BufferPool pool;
+    return pool;
+}
+
+BufferPool::~BufferPool() {
+    Clear();
+}
+
+std::shared_ptr<uint8_t> BufferPool::Acquire(size_t size) {
+    size = AlignUp(std::max<size_t>(size, 1), ROW_ALIGNMENT);
+    uint8_t *ptr = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = free_buffers_.find(size);
+        if (it != free_buffers_.end()) {
+            ptr = it->second;
+            free_buffers_.erase(it);
+        }
+    }
+    if (ptr == nullptr) {
+        ptr = static_cast<uint8_t *>(std::aligned_alloc(ROW_ALIGNMENT, size));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+    return std::shared_ptr<uint8_t>(ptr, [this, size](uint8_t *p) { Release(p, size); });
+}
+
+void BufferPool::Release(uint8_t *ptr, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_buffers_.size() < MAX_POOLED_BUFFERS) {
+            free_buffers_.emplace(size, ptr);
+            return;
+        }
+    }
+    std::free(ptr);
+}
+
+void BufferPool::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &[size, ptr] : free_buffers_) {
+        std::free(ptr);
+    }
+    free_buffers_.clear();
+}
+
+Image::Image(size_t width, size_t height, PixelFormat format)
+    : width_(width),
+      height_(height),
+      stride_(static_cast<ptrdiff_t>(AlignUp(width * BytesPerPixel(format), ROW_ALIGNMENT))),
+      format_(format),
+      storage_(BufferPool::Instance().Acquire(static_cast<size_t>(stride_) * height)),
+      data_(storage_.get()) {
+}
+
+Image Image::Wrap(const std::shared_ptr<void> &owner, uint8_t *data, size_t width, size_t height, ptrdiff_t stride,
+                  PixelFormat format) {
+    Image res;
+    res.width_ = width;
+    res.height_ = height;
+    res.stride_ = stride;
+    res.format_ = format;
+    res.storage_ = std::shared_ptr<uint8_t>(owner, data);
+    res.data_ = data;
+    return res;
+}
+
+void Image::Crop(size_t width, size_t height) {
+    width_ = std::min(width_, width);
+    height_ = std::min(height_, height);
+}
+
+Image Image::Clone() const {
+    Image res(width_, height_, format_);
+    size_t row_size = width_ * BytesPerPixel(format_);
+    ParallelFor(0, height_, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::memcpy(res.Row<uint8_t>(i), Row<uint8_t>(i), row_size);
+        }
+    });
+    return res;
+}
+
+Image Image::Converted(PixelFormat format) const {
+    if (format == format_) {
+        return Clone();
+    }
+    if (format == PixelFormat::GRAY8) {
+        throw BMPExceptions(UNSUPPORTED_CONVERSION);
+    }
+    Image res(width_, height_, format);
+    ParallelFor(0, height_, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (format_ == PixelFormat::GRAY8 && format == PixelFormat::RGBF32) {
+                UnpackGray8Row(Row<uint8_t>(i), res.Row<Pixel>(i), width_);
+            } else if (format_ == PixelFormat::GRAY8) {
+                ExpandGray8Row(Row<uint8_t>(i), res.Row<Pixel8>(i), width_);
+            } else if (format == PixelFormat::RGBF32) {
+                UnpackBGR8Row(Row<Pixel8>(i), res.Row<Pixel>(i), width_);
+            } else {
+                PackBGR8Row(Row<Pixel>(i), res.Row<Pixel8>(i), width_);
+            }
+        }
+    });
+    return res;
+}
+
+void Image::ConvertTo(PixelFormat format) {
+    if (format != format_) {
+        *this = Converted(format);
+    }
+}
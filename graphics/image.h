@@ -0,0 +1,100 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "graphics.h"
+
+// GRAY8 is a single channel, for images whose three channels are equal.
+enum class PixelFormat { BGR8, RGBF32, GRAY8 };
+
+size_t BytesPerPixel(PixelFormat format);
+size_t AlignUp(size_t value, size_t alignment);
+
+// Row conversion kernels between 8-bit BGR and float RGB, written to be auto-vectorized.
+void UnpackBGR8Row(const Pixel8 *src, Pixel *dst, size_t width);
+void PackBGR8Row(const Pixel *src, Pixel8 *dst, size_t width);
+void UnpackGray8Row(const uint8_t *src, Pixel *dst, size_t width);
+void ExpandGray8Row(const uint8_t *src, Pixel8 *dst, size_t width);
+
+// Recycles aligned pixel buffers, so scratch images of the same size do not hit the allocator again.
+class BufferPool {
+public:
+    static BufferPool &Instance();
+
+    std::shared_ptr<uint8_t> Acquire(size_t size);
+    void Clear();
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+private:
+    BufferPool() = default;
+    ~BufferPool();
+    void Release(uint8_t *ptr, size_t size);
+
+    std::mutex mutex_;
+    std::unordered_multimap<size_t, uint8_t *> free_buffers_;
+};
+
+// Contiguous row-major image with aligned rows. Rows are addressed through a byte stride,
+// so a view of a part of the image (or of a foreign buffer) does not need a copy.
+class Image {
+public:
+    Image() = default;
+    Image(size_t width, size_t height, PixelFormat format);
+    Image(Image &&oth) noexcept = default;
+    Image &operator=(Image &&oth) noexcept = default;
+    Image(const Image &oth) = delete;
+    Image &operator=(const Image &oth) = delete;
+    ~Image() = default;
+
+    size_t Width() const {
+        return width_;
+    }
+
+    size_t Height() const {
+        return height_;
+    }
+
+    PixelFormat Format() const {
+        return format_;
+    }
+
+    ptrdiff_t Stride() const {
+        return stride_;
+    }
+
+    bool Empty() const {
+        return width_ == 0 || height_ == 0;
+    }
+
+    template <typename T = Pixel>
+    T *Row(size_t i) {
+        return reinterpret_cast<T *>(data_ + static_cast<ptrdiff_t>(i) * stride_);
+    }
+
+    template <typename T = Pixel>
+    const T *Row(size_t i) const {
+        return reinterpret_cast<const T *>(data_ + static_cast<ptrdiff_t>(i) * stride_);
+    }
+
+    // View over memory owned by someone else (e.g. a mapped file); owner keeps that memory alive.
+    static Image Wrap(const std::shared_ptr<void> &owner, uint8_t *data, size_t width, size_t height,
+                      ptrdiff_t stride, PixelFormat format);
+
+    void Crop(size_t width, size_t height);
+    Image Clone() const;
+    // Copy in the given format; color images cannot be converted to GRAY8.
+    Image Converted(PixelFormat format) const;
+    void ConvertTo(PixelFormat format);
+
+private:
+    size_t width_ = 0;
+    size_t height_ = 0;
+    ptrdiff_t stride_ = 0;
+    PixelFormat format_ = PixelFormat::RGBF32;
+    std::shared_ptr<uint8_t> storage_;
+    uint8_t *data_ = nullptr;
+};
@@ -10,6 +10,9 @@ void GenerateOptions(Parser& p) {
     EdgeDetection edge(1);
     GaussianBlur blur(1);
     Anaglyph anaglyph(1);
+    Convolution conv(1);
+    Expression expr(3);
+    Resize resize(2);
     p.AddFilter(crop);
     p.AddFilter(gs);
     p.AddFilter(neg);
@@ -17,6 +20,32 @@ void GenerateOptions(Parser& p) {
     p.AddFilter(edge);
     p.AddFilter(blur);
     p.AddFilter(anaglyph);
+    p.AddFilter(conv);
+    p.AddFilter(expr);
+    p.AddFilter(resize);
+    p.AddSetting("-mmap", "memory-map the input and output files", 0);
+    p.AddSetting("-threads", "number of worker threads (0 means one per core)", 1);
+    p.AddSetting("-batch", "input is a directory, glob or manifest of images, output is a directory", 0);
+    p.AddSetting("-jobs", "number of images processed at once in batch or server mode", 1);
+    p.AddSetting("-stream", "process the image band by band with bounded memory", 0);
+    p.AddSetting("-serve", "serve jobs on a unix socket: image_processor -serve SOCKET", 1);
+    p.AddSetting("-profile", "write per-stage timings to a JSON file", 1);
+    p.AddSetting("-trace", "write per-stage timings to a Chrome trace file", 1);
+    p.AddSetting("-rle", "write images of at most 256 colors as 8-bit RLE", 0);
+    p.AddSetting("-cache", "keep decoded images, their downscaled levels and filter results in a directory", 1);
+    p.AddSetting("-cache-limit", "size of the -cache directory in megabytes before old files are evicted", 1);
+    p.AddSetting("-branch", "run the filters after it on the result of the shared ones, writing to a file", 1);
+    p.AddSetting("-preview", "process the smallest downscaled level giving at least a W x H result", 2);
+}
+
+int WriteProfile(const Parser& p, int exit_code) {
+    try {
+        p.WriteProfile();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return exit_code;
 }
 
 int main(int argc, char** argv) {
@@ -25,23 +54,48 @@ int main(int argc, char** argv) {
 
     try {
         inp.ParseBMP(argc, argv);
+        inp.ParseOptions(argc, argv);
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         inp.PrintWindow();
         return 0;
     }
+    if (inp.IsServer()) {
+        try {
+            inp.RunServer();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (inp.IsBatch()) {
+        return WriteProfile(inp, inp.RunBatch() == 0 ? 0 : 1);
+    }
+    if (inp.IsStream()) {
+        try {
+            inp.RunStream();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            inp.PrintWindow();
+        }
+        return WriteProfile(inp, 0);
+    }
     BMP file;
-    file.ReadBMP(inp.GetInputFileStream());
     try {
-        inp.ParseOptions(argc, argv, file);
+        inp.ReadInput(file);
+        inp.ApplyFilters(file);
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         inp.PrintWindow();
         return 0;
     }
-    inp.GetInputFileStream().close();
-
-    file.WriteBMP(inp.GetOutputFileStream());
 
-    inp.GetOutputFileStream().close();
-}
+    inp.WriteOutput(file);
+    try {
+        inp.RunBranches(file);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return WriteProfile(inp, 0);
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#include <utility>
+#include "io_thread.h"
+
+IoThread::IoThread(std::function<void()> body) {
+    thread_ = std::thread([this, body = std::move(body)] {
+        try {
+            body();
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+    });
+}
+
+IoThread::~IoThread() {
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void IoThread::Join() {
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <exception>
+#include <functional>
+#include <thread>
+
+// Thread of its own for blocking reads and writes, so waiting on the disk never takes a worker of the
+// pool away from the filters. The destructor waits for the body to finish.
+class IoThread {
+public:
+    explicit IoThread(std::function<void()> body);
+    IoThread(const IoThread &) = delete;
+    IoThread &operator=(const IoThread &) = delete;
+    ~IoThread();
+
+    // Waits for the body to finish and rethrows the exception it threw, if any.
+    void Join();
+
+private:
+    std::thread thread_;
+    std::exception_ptr error_;
+};
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <exception>
+#include "thread_pool.h"
+
+const size_t BANDS_PER_THREAD = 4;
+const size_t NO_QUEUE = static_cast<size_t>(-1);
+
+thread_local ThreadPool *current_pool = nullptr;
+thread_local size_t current_queue = NO_QUEUE;
+
+std::unique_ptr<ThreadPool> global_pool;
+size_t global_threads = 0;
+std::mutex global_mutex;
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<TaskQueue>());
+    }
+    for (size_t i = 0; i + 1 < threads; ++i) {
+        workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+}
+
+ThreadPool &ThreadPool::Global() {
+    std::lock_guard<std::mutex> lock(global_mutex);
+    if (!global_pool) {
+        size_t threads = global_threads != 0 ? global_threads : std::thread::hardware_concurrency();
+        global_pool = std::make_unique<ThreadPool>(threads);
+    }
+    return *global_pool;
+}
+
+void ThreadPool::SetGlobalThreads(size_t threads) {
+    std::lock_guard<std::mutex> lock(global_mutex);
+    global_threads = threads;
+    global_pool.reset();
+}
+
+void ThreadPool::Push(size_t queue, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+        queues_[queue]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        ++pending_;
+    }
+    wake_.notify_one();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+    Push(next_queue_++ % queues_.size(), std::move(task));
+}
+
+bool ThreadPool::TryRunTask(size_t self) {
+    size_t queues = queues_.size();
+    size_t start = self == NO_QUEUE ? next_queue_.load() : self;
+    for (size_t k = 0; k < queues; ++k) {
+        size_t victim = (start + k) % queues;
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(queues_[victim]->mutex);
+            auto &tasks = queues_[victim]->tasks;
+            if (tasks.empty()) {
+                continue;
+            }
+            if (victim == self) {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            } else {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            }
+        }
+        --pending_;
+        task();
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t id) {
+    current_pool = this;
+    current_queue = id;
+    while (true) {
+        if (TryRunTask(id)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &body,
+                             size_t min_band) {
+    if (begin >= end) {
+        return;
+    }
+    size_t count = end - begin;
+    size_t band = std::max({min_band, size_t{1}, (count + Size() * BANDS_PER_THREAD - 1) / (Size() * BANDS_PER_THREAD)});
+    if (Size() == 1 || band >= count) {
+        body(begin, end);
+        return;
+    }
+    size_t self = current_pool == this ? current_queue : NO_QUEUE;
+    std::atomic<size_t> remaining = (count + band - 1) / band;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    size_t queue = self == NO_QUEUE ? queues_.size() - 1 : self;
+    for (size_t from = begin; from < end; from += band) {
+        size_t to = std::min(end, from + band);
+        Push(queue, [&, from, to] {
+            try {
+                body(from, to);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            if (--remaining == 0) {
+                // Taking the mutex orders the wakeup after the wait's check of remaining.
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                wake_.notify_all();
+            }
+        });
+        queue = (queue + 1) % queues_.size();
+    }
+    // Bands may block for long (batch slots wait for their inputs), so with nothing left to steal the
+    // caller sleeps until a task is pushed or the last band is done.
+    while (remaining > 0) {
+        if (TryRunTask(self)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_.wait(lock, [&] { return remaining == 0 || pending_ > 0; });
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &body, size_t min_band) {
+    ThreadPool::Global().ParallelFor(begin, end, body, min_band);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of workers with one task deque each. A worker pops tasks from the front of its own deque and,
+// when it runs dry, steals from the back of the others. Threads waiting for a ParallelFor help to run
+// tasks before they block, so parallel loops may be nested inside submitted tasks.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool();
+
+    static ThreadPool &Global();
+    // Sets the number of threads of the global pool (0 means one per hardware thread).
+    static void SetGlobalThreads(size_t threads);
+
+    // Number of threads taking part in a ParallelFor, the calling one included.
+    size_t Size() const {
+        return workers_.size() + 1;
+    }
+
+    void Submit(std::function<void()> task);
+
+    // Splits [begin, end) into bands of at least min_band items and runs body(band_begin, band_end)
+    // for every band. Returns when all bands are done; rethrows the first exception thrown by body.
+    void ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &body,
+                     size_t min_band = 1);
+
+private:
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void Push(size_t queue, std::function<void()> task);
+    bool TryRunTask(size_t self);
+    void WorkerLoop(size_t id);
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> pending_ = 0;
+    std::atomic<size_t> next_queue_ = 0;
+    bool stop_ = false;
+};
+
+void ParallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)> &body, size_t min_band = 1);
@@ -1,34 +1,488 @@
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
 #include "parser.h"
 #include "../exceptions/exceptions.h"
+#include "../parallel/thread_pool.h"
+#include "../pipeline/pipeline.h"
+#include "../profile/profiler.h"
+#include "../server/server.h"
+#include "../stream/stream.h"
+
+const std::string MMAP_SETTING = "-mmap";
+const std::string THREADS_SETTING = "-threads";
+const std::string BATCH_SETTING = "-batch";
+const std::string JOBS_SETTING = "-jobs";
+const std::string SERVE_SETTING = "-serve";
+const std::string STREAM_SETTING = "-stream";
+const std::string PROFILE_SETTING = "-profile";
+const std::string TRACE_SETTING = "-trace";
+const std::string RLE_SETTING = "-rle";
+const std::string CACHE_SETTING = "-cache";
+const std::string PREVIEW_SETTING = "-preview";
+const std::string CACHE_LIMIT_SETTING = "-cache-limit";
+const std::string BRANCH_SETTING = "-branch";
+const size_t DEFAULT_CACHE_LIMIT_MB = 1024;
+const size_t BYTES_PER_MB = 1 << 20;
+const size_t SERVER_JOBS_PER_THREAD = 2;
+const size_t SERVER_CONNECTIONS_PER_JOB = 8;
+
+Parser& Parser::AddSetting(const std::string& name, const std::string& help, size_t args_cnt) {
+    setting_options_.push_back({name, help, args_cnt});
+    return *this;
+}
 
 void Parser::PrintWindow() {
     std::cerr << fc_.GenerateWindow();
+    for (const auto& s : setting_options_) {
+        std::cerr << s.name << ",    " << s.help << "\n";
+    }
 }
 
 void Parser::ParseBMP(size_t argc, char** argv) {
+    parse_start_ = ProfileSample::Now();
     if (argc == 1) {
         throw OptionExceptions(EMPTY_OPTIONS);
     }
+    // Modes like -serve take no input and output files, so the options start right away.
+    if (std::any_of(setting_options_.begin(), setting_options_.end(),
+                    [&](const Setting& s) { return s.name == argv[1]; })) {
+        options_begin_ = 1;
+        return;
+    }
     if (argc == 2) {
         throw OptionExceptions(EMPTY_OUTPUT_FILE);
     }
-    char* input_file_name = argv[1];
-    char* output_file_name = argv[2];
-    input_file_stream_ = std::ifstream(input_file_name, std::ifstream::binary);
+    input_file_name_ = argv[1];
+    output_file_name_ = argv[2];
+}
+
+void Parser::OpenFiles() {
+    input_file_stream_ = std::ifstream(input_file_name_, std::ifstream::binary);
     if (!input_file_stream_.is_open()) {
         throw OptionExceptions(INVALID_INPUT_FILE);
     }
-    output_file_stream_ = std::ofstream(output_file_name, std::ofstream::binary);
+    output_file_stream_ = std::ofstream(output_file_name_, std::ofstream::binary);
     if (!output_file_stream_.is_open()) {
         throw OptionExceptions(INVALID_OUTPUT_FILE);
     }
 }
 
-void Parser::ParseOptions(size_t argc, char** argv, BMP& bmp) {
-    for (size_t i = 3; i < argc;) {
+void Parser::ParseOptions(size_t argc, char** argv) {
+    for (size_t i = options_begin_; i < argc;) {
+        // Filters after -branch go to the chain of that branch, so the option can be given many times.
+        if (argv[i] == BRANCH_SETTING) {
+            if (i + 1 >= argc) {
+                throw OptionExceptions(INVALID_OPTIONS);
+            }
+            branches_.push_back({argv[i + 1], {}, {}, {}});
+            i += 2;
+            continue;
+        }
+        auto setting = std::find_if(setting_options_.begin(), setting_options_.end(),
+                                    [&](const Setting& s) { return s.name == argv[i]; });
+        if (setting != setting_options_.end()) {
+            if (i + setting->args_cnt >= argc) {
+                throw OptionExceptions(INVALID_OPTIONS);
+            }
+            settings_[setting->name] = std::vector<std::string>(argv + i + 1, argv + i + 1 + setting->args_cnt);
+            i += setting->args_cnt + 1;
+            continue;
+        }
         const std::unique_ptr<Filter>& f_ptr = fc_.GiveFilterPattern(argv[i]);
         std::unique_ptr<Filter> f_clone = f_ptr->Clone();
         i = f_clone->Parse(argc, argv, i + 1);
-        f_clone->Apply(bmp);
+        (branches_.empty() ? chain_ : branches_.back().chain).push_back(std::move(f_clone));
+    }
+    stages_ = PlanPipeline(chain_);
+    gray_stages_ = PlanPipeline(chain_, true);
+    for (auto& branch : branches_) {
+        branch.stages = PlanPipeline(branch.chain);
+        branch.gray_stages = PlanPipeline(branch.chain, true);
+    }
+    if (HasSetting(PROFILE_SETTING) || HasSetting(TRACE_SETTING)) {
+        Profiler::Global().Enable();
+        Profiler::Global().Record("parse", "parse", parse_start_, 0);
+    }
+    if (HasSetting(THREADS_SETTING)) {
+        ThreadPool::SetGlobalThreads(std::stoul(GetSetting(THREADS_SETTING)[0]));
+    }
+    if (HasSetting(CACHE_SETTING)) {
+        size_t limit = HasSetting(CACHE_LIMIT_SETTING) ? std::stoul(GetSetting(CACHE_LIMIT_SETTING)[0])
+                                                       : DEFAULT_CACHE_LIMIT_MB;
+        cache_.emplace(GetSetting(CACHE_SETTING)[0]);
+        results_.emplace(GetSetting(CACHE_SETTING)[0], limit * BYTES_PER_MB);
+    }
+    if (IsServer()) {
+        return;
+    }
+    if (options_begin_ != 3) {
+        throw OptionExceptions(EMPTY_OUTPUT_FILE);
+    }
+    if (IsBatch()) {
+        batch_jobs_ = ListBatchJobs(input_file_name_, output_file_name_);
+        for (const auto& branch : branches_) {
+            std::error_code error;
+            std::filesystem::create_directories(branch.output, error);
+            if (error) {
+                throw OptionExceptions(INVALID_OUTPUT_FILE);
+            }
+        }
+    } else {
+        OpenFiles();
+    }
+}
+
+bool Parser::HasSetting(const std::string& name) const {
+    return settings_.contains(name);
+}
+
+const std::vector<std::string>& Parser::GetSetting(const std::string& name) const {
+    auto it = settings_.find(name);
+    if (it == settings_.end()) {
+        throw OptionExceptions(INVALID_OPTIONS);
+    }
+    return it->second;
+}
+
+void Parser::ReadInput(BMP& bmp) {
+    LoadedInput loaded = ReadInput(bmp, input_file_stream_, input_file_name_);
+    input_file_stream_.close();
+    if (loaded.gray) {
+        stages_ = std::move(gray_stages_);
+    }
+    if (loaded.level > 0) {
+        stages_ = ScaleStages(stages_, loaded.level);
+        for (auto& branch : branches_) {
+            branch.stages = ScaleStages(branch.stages, loaded.level);
+            branch.gray_stages = ScaleStages(branch.gray_stages, loaded.level);
+        }
+    }
+    key_ = loaded.key;
+}
+
+size_t ImageBytes(const Image& image) {
+    return image.Width() * image.Height() * BytesPerPixel(image.Format());
+}
+
+LoadedInput Parser::ReadInput(BMP& bmp, std::istream& input, const std::string& input_file_name,
+                              std::optional<uint64_t> content_hash) const {
+    ProfileScope scope("read", "io");
+    bool gray = IsGrayInput(input);
+    const std::vector<std::unique_ptr<Filter>>& stages = gray ? gray_stages_ : stages_;
+    std::optional<PyramidEntry> entry;
+    uint64_t hash = 0;
+    if (cache_) {
+        hash = content_hash ? *content_hash : FileHash(input_file_name);
+        entry = cache_->Open(hash, input);
+    }
+    size_t level = 0;
+    if (entry) {
+        level = PreviewLevel(entry->Width(0), entry->Height(0), entry->Levels());
+        entry->Load(level, bmp, PlannedFormat(stages));
+    } else {
+        if (HasSetting(MMAP_SETTING)) {
+            bmp.MapBMP(input, MappedFile::OpenRead(input_file_name), PlannedFormat(stages));
+        } else {
+            ReadPlanned(bmp, input, stages);
+        }
+        // Without a cache the pyramid level is made on the spot.
+        level = PreviewLevel(bmp.bmp_ih.bi_width, bmp.bmp_ih.bi_height,
+                             PyramidLevels(bmp.bmp_ih.bi_width, bmp.bmp_ih.bi_height));
+        for (size_t k = 0; k < level; ++k) {
+            bmp.image = HalveImage(bmp.image);
+            if (!bmp.alpha.Empty()) {
+                bmp.alpha = HalveImage(bmp.alpha);
+            }
+        }
+    }
+    scope.SetBytes(bmp.bmp_fh.bf_size);
+    return {level, InputKey(hash, level, bmp.image.Format()), gray};
+}
+
+// Deepest of the levels at which the output of the stages is still at least the size -preview asks for.
+size_t Parser::PreviewLevel(size_t width, size_t height, size_t levels) const {
+    if (!HasSetting(PREVIEW_SETTING)) {
+        return 0;
+    }
+    size_t min_width = std::stoul(GetSetting(PREVIEW_SETTING)[0]);
+    size_t min_height = std::stoul(GetSetting(PREVIEW_SETTING)[1]);
+    for (const auto& stage : stages_) {
+        if (const auto* crop = dynamic_cast<const Crop*>(stage.get())) {
+            width = std::min(width, crop->Width());
+            height = std::min(height, crop->Height());
+        } else if (const auto* resize = dynamic_cast<const Resize*>(stage.get())) {
+            width = resize->Width();
+            height = resize->Height();
+        }
+    }
+    size_t level = 0;
+    while (level + 1 < levels && (width >> (level + 1)) >= min_width && (height >> (level + 1)) >= min_height) {
+        ++level;
+    }
+    return level;
+}
+
+void Parser::ApplyFilters(BMP& bmp) {
+    key_ = ApplyFilters(bmp, stages_, key_);
+}
+
+uint64_t Parser::ApplyFilters(BMP& bmp, const std::vector<std::unique_ptr<Filter>>& stages, uint64_t key) const {
+    std::vector<uint64_t> keys;
+    size_t done = 0;
+    if (results_) {
+        for (const auto& f : stages) {
+            key = StageKey(key, *f);
+            keys.push_back(key);
+        }
+        ProfileScope scope("cache", "io");
+        done = stages.size();
+        while (done > 0 && !results_->Load(keys[done - 1], bmp)) {
+            --done;
+        }
+    }
+    for (size_t k = done; k < stages.size(); ++k) {
+        ProfileScope scope(stages[k]->name, "filter");
+        size_t bytes = ImageBytes(bmp.image);
+        stages[k]->Apply(bmp);
+        scope.SetBytes(bytes + ImageBytes(bmp.image));
+        if (results_) {
+            results_->Store(keys[k], bmp);
+        }
+    }
+    if (results_ && done < stages.size()) {
+        results_->Trim();
+    }
+    return keys.empty() ? key : keys.back();
+}
+
+void Parser::RunBranches(BMP& bmp) const {
+    RunBranches(bmp, 0, key_, std::string(), nullptr);
+}
+
+void Parser::RunBranches(BMP& bmp, size_t level, uint64_t key, const std::string& file_name,
+                         BatchOutputs* outputs) const {
+    if (branches_.empty()) {
+        return;
+    }
+    // A branch gets the image in the format it would have been read in for the branch alone; widening
+    // 8-bit images to float is exact, so the result is the same as running the whole chain.
+    bool gray = bmp.image.Format() == PixelFormat::GRAY8;
+    std::vector<PixelFormat> formats;
+    for (const auto& branch : branches_) {
+        const auto& stages = gray ? branch.gray_stages : branch.stages;
+        formats.push_back(PlannedFormat(stages) == PixelFormat::RGBF32 ? PixelFormat::RGBF32 : bmp.image.Format());
+    }
+    // A main image whose write is deferred is still needed, so then every branch gets a copy.
+    size_t copied = outputs == nullptr ? branches_.size() - 1 : branches_.size();
+    std::vector<BMP> copies(branches_.size());
+    for (size_t k = 0; k < copied; ++k) {
+        copies[k].bmp_fh = bmp.bmp_fh;
+        copies[k].bmp_ih = bmp.bmp_ih;
+        copies[k].palette = bmp.palette;
+        copies[k].image = bmp.image.Converted(formats[k]);
+        if (!bmp.alpha.Empty()) {
+            copies[k].alpha = bmp.alpha.Clone();
+        }
     }
+    if (outputs == nullptr) {
+        copies.back() = std::move(bmp);
+        copies.back().image.ConvertTo(formats.back());
+    }
+    BatchOutputs writes(branches_.size());
+    // Branches run at once, each as a task of the pool whose filters parallelize further.
+    ParallelFor(0, branches_.size(), [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            const Branch& branch = branches_[k];
+            std::string output_file_name =
+                file_name.empty() ? branch.output : (std::filesystem::path(branch.output) / file_name).string();
+            std::ofstream output;
+            if (outputs == nullptr) {
+                output.open(output_file_name, std::ofstream::binary);
+                if (!output.is_open()) {
+                    throw OptionExceptions(INVALID_OUTPUT_FILE);
+                }
+            }
+            const auto& stages = gray ? branch.gray_stages : branch.stages;
+            if (level > 0) {
+                ApplyFilters(copies[k], ScaleStages(stages, level), key);
+            } else {
+                ApplyFilters(copies[k], stages, key);
+            }
+            if (outputs == nullptr) {
+                WriteOutput(copies[k], output, output_file_name);
+            } else {
+                writes[k] = DeferOutput(std::move(copies[k]), output_file_name);
+            }
+        }
+    });
+    if (outputs != nullptr) {
+        std::move(writes.begin(), writes.end(), std::back_inserter(*outputs));
+    }
+}
+
+void Parser::WriteOutput(BMP& bmp) {
+    WriteOutput(bmp, output_file_stream_, output_file_name_);
+}
+
+void Parser::WriteOutput(BMP& bmp, std::ofstream& output, const std::string& output_file_name) const {
+    ProfileScope scope("write", "io");
+    // The size of RLE output is known only once it is encoded, so it is never mapped.
+    bool rle = HasSetting(RLE_SETTING);
+    if (HasSetting(MMAP_SETTING) && !rle) {
+        output.close();
+        bmp.WriteMappedBMP(output_file_name);
+    } else {
+        bmp.WriteBMP(output, rle);
+        output.close();
+    }
+    scope.SetBytes(bmp.bmp_fh.bf_size);
+}
+
+BatchOutput Parser::DeferOutput(BMP&& bmp, const std::string& output_file_name) const {
+    // std::function needs a copyable target, and images are move-only.
+    auto image = std::make_shared<BMP>(std::move(bmp));
+    auto write = [this, image, output_file_name] {
+        std::ofstream output(output_file_name, std::ofstream::binary);
+        if (!output.is_open()) {
+            throw OptionExceptions(INVALID_OUTPUT_FILE);
+        }
+        WriteOutput(*image, output, output_file_name);
+    };
+    return {output_file_name, write};
+}
+
+void Parser::WriteProfile() const {
+    for (const auto& [setting, chrome] : {std::pair{PROFILE_SETTING, false}, std::pair{TRACE_SETTING, true}}) {
+        if (!HasSetting(setting)) {
+            continue;
+        }
+        std::ofstream output(GetSetting(setting)[0]);
+        if (!output.is_open()) {
+            throw OptionExceptions(INVALID_OUTPUT_FILE);
+        }
+        if (chrome) {
+            Profiler::Global().WriteChromeTrace(output);
+        } else {
+            Profiler::Global().WriteJSON(output);
+        }
+    }
+}
+
+bool Parser::IsBatch() const {
+    return HasSetting(BATCH_SETTING);
+}
+
+size_t Parser::RunBatch() {
+    size_t jobs = HasSetting(JOBS_SETTING) ? std::stoul(GetSetting(JOBS_SETTING)[0]) : ThreadPool::Global().Size();
+    // Mapped inputs are read page by page as they are decoded, so they are not read ahead.
+    bool mmap = HasSetting(MMAP_SETTING);
+    // Filters keep no state between calls, so all jobs share the stages planned once in ParseOptions.
+    return ::RunBatch(batch_jobs_, jobs, !mmap, [this](const BatchJob& job, const BatchInput& input,
+                                                      BatchOutputs& outputs) {
+        BMP bmp;
+        LoadedInput loaded = {};
+        if (input.file) {
+            MemoryStream stream(input.file->Data(), input.file->Size());
+            uint64_t hash = cache_ ? ContentHash(input.file->Data(), input.file->Size()) : 0;
+            loaded = ReadInput(bmp, stream, job.input, hash);
+        } else {
+            std::ifstream stream(job.input, std::ifstream::binary);
+            if (!stream.is_open()) {
+                throw OptionExceptions(INVALID_INPUT_FILE);
+            }
+            loaded = ReadInput(bmp, stream, job.input);
+        }
+        const auto& stages = loaded.gray ? gray_stages_ : stages_;
+        uint64_t key = 0;
+        if (loaded.level > 0) {
+            key = ApplyFilters(bmp, ScaleStages(stages, loaded.level), loaded.key);
+        } else {
+            key = ApplyFilters(bmp, stages, loaded.key);
+        }
+        RunBranches(bmp, loaded.level, key, std::filesystem::path(job.output).filename().string(), &outputs);
+        outputs.insert(outputs.begin(), DeferOutput(std::move(bmp), job.output));
+    });
+}
+
+bool Parser::IsStream() const {
+    return HasSetting(STREAM_SETTING);
+}
+
+void Parser::RunStream() {
+    ProfileScope scope("stream", "stream");
+    // The alpha channel is not streamed, RLE rows cannot be sought to and branches need the whole result
+    // of the shared filters, so such images are processed whole.
+    BMP headers;
+    headers.ReadHeaders(input_file_stream_);
+    input_file_stream_.seekg(0, std::ios_base::beg);
+    if (!CanStream(stages_) || headers.HasAlpha() || headers.IsRLE() || HasSetting(RLE_SETTING) ||
+        !branches_.empty()) {
+        BMP bmp;
+        ReadInput(bmp);
+        ApplyFilters(bmp);
+        WriteOutput(bmp);
+        RunBranches(bmp);
+        return;
+    }
+    StreamBMP(input_file_stream_, output_file_stream_, stages_);
+    input_file_stream_.close();
+    output_file_stream_.close();
+}
+
+bool Parser::IsServer() const {
+    return HasSetting(SERVE_SETTING);
+}
+
+std::vector<std::unique_ptr<Filter>> Parser::ParseChain(const std::vector<std::string>& args) const {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    std::vector<std::unique_ptr<Filter>> chain;
+    for (size_t i = 0; i < argv.size();) {
+        std::unique_ptr<Filter> f_clone = fc_.GiveFilterPattern(argv[i])->Clone();
+        i = f_clone->Parse(argv.size(), argv.data(), i + 1);
+        chain.push_back(std::move(f_clone));
+    }
+    return chain;
+}
+
+void Parser::RunServer() {
+    size_t jobs = HasSetting(JOBS_SETTING) ? std::stoul(GetSetting(JOBS_SETTING)[0])
+                                           : ThreadPool::Global().Size() * SERVER_JOBS_PER_THREAD;
+    size_t connections = jobs * SERVER_CONNECTIONS_PER_JOB;
+    // As many jobs may wait as run, so a worker that finishes always has the next one at hand.
+    Server server(GetSetting(SERVE_SETTING)[0], jobs, jobs, connections, [this](const ServerJob& job) {
+        std::vector<std::unique_ptr<Filter>> chain = ParseChain(job.args);
+        std::vector<std::unique_ptr<Filter>> stages;
+        BMP bmp;
+        if (job.input.empty()) {
+            std::istringstream input(job.data);
+            stages = PlanPipeline(chain, IsGrayInput(input));
+            ReadPlanned(bmp, input, stages);
+        } else {
+            std::ifstream input(job.input, std::ifstream::binary);
+            if (!input.is_open()) {
+                throw OptionExceptions(INVALID_INPUT_FILE);
+            }
+            stages = PlanPipeline(chain, IsGrayInput(input));
+            ReadPlanned(bmp, input, stages);
+        }
+        for (const auto& f : stages) {
+            f->Apply(bmp);
+        }
+        if (job.output == "-") {
+            std::ostringstream output;
+            bmp.WriteBMP(output);
+            return output.str();
+        }
+        std::ofstream output(job.output, std::ofstream::binary);
+        if (!output.is_open()) {
+            throw OptionExceptions(INVALID_OUTPUT_FILE);
+        }
+        bmp.WriteBMP(output);
+        return std::string();
+    });
+    server.Run();
 }
@@ -2,9 +2,38 @@
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
+#include "../batch/batch.h"
+#include "../cache/pyramid_cache.h"
+#include "../cache/result_cache.h"
 #include "../filters/filters.h"
+#include "../profile/profiler.h"
+
+// Pyramid level an input was read at and the ResultCache key of the image read.
+struct LoadedInput {
+    size_t level;
+    uint64_t key;
+    // Whether the input is gray (IsGrayInput), so it goes through the stages planned for gray inputs.
+    bool gray;
+};
+
+// Filter chain run on a copy of the image the shared filters produced, written to its own output.
+struct Branch {
+    std::string output;
+    std::vector<std::unique_ptr<Filter>> chain;
+    std::vector<std::unique_ptr<Filter>> stages;
+    // For a GRAY8 result of the shared filters.
+    std::vector<std::unique_ptr<Filter>> gray_stages;
+};
+
+struct Setting {
+    std::string name;
+    std::string help;
+    size_t args_cnt;
+};
 
 class Parser {
 public:
@@ -14,9 +43,48 @@ public:
         return *this;
     }
 
+    Parser& AddSetting(const std::string& name, const std::string& help, size_t args_cnt);
+
     void ParseBMP(size_t argc, char* argv[]);
 
-    void ParseOptions(size_t argc, char* argv[], BMP& bmp);
+    void ParseOptions(size_t argc, char* argv[]);
+
+    void ReadInput(BMP& bmp);
+
+    void ApplyFilters(BMP& bmp);
+
+    // Runs every -branch chain on a copy of bmp, which the shared filters were applied to, and writes its output.
+    // The last branch takes bmp itself, so it is called once bmp is written.
+    void RunBranches(BMP& bmp) const;
+
+    void WriteOutput(BMP& bmp);
+
+    // Writes the timings collected for -profile (JSON) and -trace (Chrome trace), if requested.
+    void WriteProfile() const;
+
+    bool IsBatch() const;
+
+    // Runs the parsed pipeline over every image of the batch; returns the number of failed images.
+    size_t RunBatch();
+
+    bool IsStream() const;
+
+    // Streams the input through the stages band by band; falls back to whole-image processing
+    // when some stage needs unbounded context.
+    void RunStream();
+
+    bool IsServer() const;
+
+    // Serves jobs on the socket given to -serve; every job brings its own filter chain.
+    [[noreturn]] void RunServer();
+
+    // Parses a filter chain given as separate arguments; settings are not accepted here. It is planned once
+    // the input is known, see PlanPipeline.
+    std::vector<std::unique_ptr<Filter>> ParseChain(const std::vector<std::string>& args) const;
+
+    bool HasSetting(const std::string& name) const;
+
+    const std::vector<std::string>& GetSetting(const std::string& name) const;
 
     std::ifstream& GetInputFileStream() {
         return input_file_stream_;
@@ -29,7 +97,39 @@ public:
     void PrintWindow();
 
 private:
+    void OpenFiles();
+    // content_hash is the FileHash of the input, when the caller already has it.
+    LoadedInput ReadInput(BMP& bmp, std::istream& input, const std::string& input_file_name,
+                          std::optional<uint64_t> content_hash = std::nullopt) const;
+    size_t PreviewLevel(size_t width, size_t height, size_t levels) const;
+    // Resumes from the result of the longest prefix of the stages found in the result cache, if there is one.
+    // Returns the key of the result.
+    uint64_t ApplyFilters(BMP& bmp, const std::vector<std::unique_ptr<Filter>>& stages, uint64_t key) const;
+    // In batch mode outputs of branches are directories and file_name is the name of the image in them.
+    // With outputs their writes are deferred into it.
+    void RunBranches(BMP& bmp, size_t level, uint64_t key, const std::string& file_name,
+                     BatchOutputs* outputs) const;
+    void WriteOutput(BMP& bmp, std::ofstream& output, const std::string& output_file_name) const;
+    // Write of bmp by WriteOutput, to be run later.
+    BatchOutput DeferOutput(BMP&& bmp, const std::string& output_file_name) const;
+
     FilterController fc_;
+    std::vector<Setting> setting_options_;
+    std::unordered_map<std::string, std::vector<std::string>> settings_;
+    std::vector<std::unique_ptr<Filter>> chain_;
+    std::vector<std::unique_ptr<Filter>> stages_;
+    // Planned with gray_input; the single-image paths move them into stages_ once the input is known to be gray.
+    std::vector<std::unique_ptr<Filter>> gray_stages_;
+    std::vector<Branch> branches_;
+    size_t options_begin_ = 3;
+    ProfileSample parse_start_;
+    std::string input_file_name_;
+    std::string output_file_name_;
     std::ifstream input_file_stream_;
     std::ofstream output_file_stream_;
-};
\ No newline at end of file
+    std::vector<BatchJob> batch_jobs_;
+    std::optional<PyramidCache> cache_;
+    std::optional<ResultCache> results_;
+    // ResultCache key of the image read, and of the result once the shared filters are applied.
+    uint64_t key_ = 0;
+};
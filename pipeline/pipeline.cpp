@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <string>
+#include "pipeline.h"
+
+using Kind = PointOp::Kind;
+
+// Appends op to ops, cancelling it against the previous operation where possible.
+void PushPointOp(std::vector<PointOp> &ops, const PointOp &op) {
+    if (!ops.empty()) {
+        Kind last = ops.back().kind;
+        if (op.kind == Kind::NEGATIVE && last == Kind::NEGATIVE) {
+            ops.pop_back();
+            return;
+        }
+        // Grayscale and threshold results are already gray.
+        if (op.kind == Kind::GRAY_SCALE && (last == Kind::GRAY_SCALE || last == Kind::THRESHOLD)) {
+            return;
+        }
+    }
+    ops.push_back(op);
+}
+
+void FlushPointOps(std::vector<PointOp> &ops, std::vector<std::unique_ptr<Filter>> &stages) {
+    if (ops.size() == 1 && ops[0].kind == Kind::GRAY_SCALE) {
+        stages.push_back(std::make_unique<GrayScale>(0));
+    } else if (ops.size() == 1 && ops[0].kind == Kind::NEGATIVE) {
+        stages.push_back(std::make_unique<Negative>(0));
+    } else if (!ops.empty()) {
+        stages.push_back(std::make_unique<FusedPointwise>(ops));
+    }
+    ops.clear();
+}
+
+size_t Grow(size_t extent, size_t halo) {
+    if (extent == UNBOUNDED || halo == UNBOUNDED || extent > UNBOUNDED - halo) {
+        return UNBOUNDED;
+    }
+    return extent + halo;
+}
+
+std::unique_ptr<Filter> MakeCrop(size_t width, size_t height) {
+    auto crop = std::make_unique<Crop>(2);
+    crop->args = {std::to_string(width), std::to_string(height)};
+    return crop;
+}
+
+// Walks the stages backwards, working out which top-left part of its input every stage really
+// needs, and crops the input of each stage to that part. Crops become views, so this costs nothing,
+// while every expensive stage only processes the region that reaches the output (plus kernel halos).
+std::vector<std::unique_ptr<Filter>> PushDownCrops(std::vector<std::unique_ptr<Filter>> stages) {
+    std::vector<Halo> needed(stages.size());
+    Halo extent = {UNBOUNDED, UNBOUNDED};
+    for (size_t k = stages.size(); k--;) {
+        if (const auto *crop = dynamic_cast<const Crop *>(stages[k].get())) {
+            extent = {std::min(extent.rows, crop->Height()), std::min(extent.cols, crop->Width())};
+        } else {
+            Halo halo = stages[k]->GetHalo();
+            extent = {Grow(extent.rows, halo.rows), Grow(extent.cols, halo.cols)};
+        }
+        needed[k] = extent;
+    }
+    std::vector<std::unique_ptr<Filter>> res;
+    for (size_t k = 0; k < stages.size(); ++k) {
+        if (needed[k].rows != UNBOUNDED || needed[k].cols != UNBOUNDED) {
+            if (const auto *last = res.empty() ? nullptr : dynamic_cast<const Crop *>(res.back().get())) {
+                needed[k] = {std::min(needed[k].rows, last->Height()), std::min(needed[k].cols, last->Width())};
+                res.pop_back();
+            }
+            res.push_back(MakeCrop(needed[k].cols, needed[k].rows));
+        }
+        if (!dynamic_cast<const Crop *>(stages[k].get())) {
+            res.push_back(std::move(stages[k]));
+        }
+    }
+    return res;
+}
+
+// The 8-bit path gives the same bytes as the float one, except that grayscale and resizing round to whole
+// levels. A kernel filter after them would amplify that rounding, so such chains stay in float. Grayscale
+// of a gray input is the identity and rounds nothing.
+bool Use8BitPipeline(const std::vector<std::unique_ptr<Filter>> &chain, bool gray_input) {
+    bool rounded = false;
+    for (const auto &filter : chain) {
+        if (!filter->Supports8Bit()) {
+            return false;
+        }
+        std::optional<PointOp> op = filter->AsPointOp();
+        bool resize = dynamic_cast<const Resize *>(filter.get()) != nullptr;
+        if (rounded && !op && !resize && !dynamic_cast<const Crop *>(filter.get())) {
+            return false;
+        }
+        rounded |= resize || (op && op->kind == Kind::GRAY_SCALE && !gray_input);
+    }
+    return true;
+}
+
+std::vector<std::unique_ptr<Filter>> PlanPipeline(const std::vector<std::unique_ptr<Filter>> &chain, bool gray_input) {
+    std::vector<std::unique_ptr<Filter>> stages;
+    std::vector<PointOp> ops;
+    // Kernel filters have 8-bit implementations of their own, which lowering would lose.
+    bool keep_whole = Use8BitPipeline(chain, gray_input);
+    for (const auto &filter : chain) {
+        std::vector<std::unique_ptr<Filter>> lowered;
+        if (keep_whole) {
+            lowered.push_back(filter->Clone());
+        } else {
+            lowered = filter->Lower();
+        }
+        for (auto &stage : lowered) {
+            if (std::optional<PointOp> op = stage->AsPointOp()) {
+                PushPointOp(ops, *op);
+                continue;
+            }
+            FlushPointOps(ops, stages);
+            stages.push_back(std::move(stage));
+        }
+    }
+    FlushPointOps(ops, stages);
+    return PushDownCrops(std::move(stages));
+}
+
+bool Supports8Bit(const std::vector<std::unique_ptr<Filter>> &stages) {
+    return std::all_of(stages.begin(), stages.end(), [](const auto &stage) { return stage->Supports8Bit(); });
+}
+
+PixelFormat PlannedFormat(const std::vector<std::unique_ptr<Filter>> &stages) {
+    return Supports8Bit(stages) ? PixelFormat::GRAY8 : PixelFormat::RGBF32;
+}
+
+bool IsGrayInput(std::istream &input) {
+    std::streampos start = input.tellg();
+    BMP headers;
+    headers.ReadHeaders(input);
+    // A file that fails here fails the same way when it is read for real.
+    input.clear();
+    input.seekg(start);
+    return headers.IsGray();
+}
+
+void ReadPlanned(BMP &bmp, std::istream &input, const std::vector<std::unique_ptr<Filter>> &stages) {
+    PixelFormat format = PlannedFormat(stages);
+    if (const auto *crop = stages.empty() ? nullptr : dynamic_cast<const Crop *>(stages.front().get())) {
+        bmp.ReadBMP(input, format, crop->Width(), crop->Height());
+    } else {
+        bmp.ReadBMP(input, format);
+    }
+}
+
+std::vector<std::unique_ptr<Filter>> ScaleStages(const std::vector<std::unique_ptr<Filter>> &stages, size_t level) {
+    double scale = 1.0 / static_cast<double>(size_t{1} << level);
+    std::vector<std::unique_ptr<Filter>> res;
+    for (const auto &stage : stages) {
+        res.push_back(stage->Scaled(scale));
+    }
+    return res;
+}
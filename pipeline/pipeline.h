@@ -0,0 +1,29 @@
+#pragma once
+#include <istream>
+#include <memory>
+#include <vector>
+#include "../filters/filters.h"
+
+// Turns the parsed filter chain into the stages that are actually run: filters are lowered into
+// simpler stages, operations that cancel out are dropped (double negative, repeated grayscale)
+// and consecutive per-pixel operations are fused into a single pass over the image. Crops are moved
+// as early as possible, so the stages before them only compute the region that is kept.
+// When every filter of the chain has an exact 8-bit implementation, filters are kept whole instead of
+// being lowered, so the image is never converted to float. gray_input plans for an input IsGrayInput
+// holds for, which grayscale leaves as it is.
+std::vector<std::unique_ptr<Filter>> PlanPipeline(const std::vector<std::unique_ptr<Filter>> &chain,
+                                                  bool gray_input = false);
+
+// Whether the BMP file input is at is read as GRAY8 when the stages allow it. input is left where it was.
+bool IsGrayInput(std::istream &input);
+
+// Narrowest format the stages accept: GRAY8 when they all work on 8-bit images, which ReadBMP widens to
+// BGR8 for color files.
+PixelFormat PlannedFormat(const std::vector<std::unique_ptr<Filter>> &stages);
+
+// Reads the image for the planned stages: when they start with a crop, only the kept region is decoded.
+// The image stays 8-bit when the stages allow it.
+void ReadPlanned(BMP &bmp, std::istream &input, const std::vector<std::unique_ptr<Filter>> &stages);
+
+// Stages for the image scaled down 2^level times, as for a level of an image pyramid.
+std::vector<std::unique_ptr<Filter>> ScaleStages(const std::vector<std::unique_ptr<Filter>> &stages, size_t level);
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sys/resource.h>
+#include "profiler.h"
+
+const double MICROSECONDS = 1e6;
+const int OUTPUT_PRECISION = 1;
+
+double ToMicroseconds(const timeval &time) {
+    return static_cast<double>(time.tv_sec) * MICROSECONDS + static_cast<double>(time.tv_usec);
+}
+
+// ru_maxrss is the peak resident set size of the process so far, in kilobytes on Linux.
+rusage Usage() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage;
+}
+
+ProfileSample ProfileSample::Now() {
+    static const std::chrono::steady_clock::time_point START = std::chrono::steady_clock::now();
+    rusage usage = Usage();
+    std::chrono::duration<double, std::micro> wall = std::chrono::steady_clock::now() - START;
+    return {wall.count(), ToMicroseconds(usage.ru_utime) + ToMicroseconds(usage.ru_stime)};
+}
+
+Profiler &Profiler::Global() {
+    static Profiler profiler;
+    return profiler;
+}
+
+size_t Profiler::ThreadIndex(std::thread::id id) {
+    return threads_.try_emplace(id, threads_.size()).first->second;
+}
+
+void Profiler::Record(const std::string &name, const std::string &category, const ProfileSample &start,
+                      size_t bytes) {
+    if (!Enabled()) {
+        return;
+    }
+    ProfileSample end = ProfileSample::Now();
+    size_t peak_rss_kb = static_cast<size_t>(Usage().ru_maxrss);
+    std::lock_guard lock(mutex_);
+    records_.push_back({name, category, ThreadIndex(std::this_thread::get_id()), start.wall_us,
+                        end.wall_us - start.wall_us, end.cpu_us - start.cpu_us, bytes, peak_rss_kb});
+}
+
+struct StageTotal {
+    std::string category;
+    size_t count = 0;
+    ProfileRecord sum;
+};
+
+void WriteRecordFields(std::ostream &out, const ProfileRecord &record) {
+    out << "\"cpu_us\": " << record.cpu_us << ", \"bytes\": " << record.bytes
+        << ", \"peak_rss_kb\": " << record.peak_rss_kb;
+}
+
+void Profiler::WriteJSON(std::ostream &out) const {
+    std::lock_guard lock(mutex_);
+    out << std::fixed << std::setprecision(OUTPUT_PRECISION) << "{\n  \"stages\": [";
+    std::map<std::string, StageTotal> totals;
+    for (size_t k = 0; k < records_.size(); ++k) {
+        const ProfileRecord &record = records_[k];
+        out << (k == 0 ? "\n" : ",\n") << "    {\"name\": \"" << record.name << "\", \"category\": \""
+            << record.category << "\", \"thread\": " << record.thread << ", \"start_us\": " << record.start_us
+            << ", \"wall_us\": " << record.wall_us << ", ";
+        WriteRecordFields(out, record);
+        out << "}";
+        StageTotal &total = totals[record.name];
+        total.category = record.category;
+        ++total.count;
+        total.sum.wall_us += record.wall_us;
+        total.sum.cpu_us += record.cpu_us;
+        total.sum.bytes += record.bytes;
+        total.sum.peak_rss_kb = std::max(total.sum.peak_rss_kb, record.peak_rss_kb);
+    }
+    out << "\n  ],\n  \"totals\": [";
+    bool first = true;
+    for (const auto &[name, total] : totals) {
+        out << (first ? "\n" : ",\n") << "    {\"name\": \"" << name << "\", \"category\": \"" << total.category
+            << "\", \"count\": " << total.count << ", \"wall_us\": " << total.sum.wall_us << ", ";
+        WriteRecordFields(out, total.sum);
+        out << "}";
+        first = false;
+    }
+    ProfileSample now = ProfileSample::Now();
+    out << "\n  ],\n  \"process\": {\"wall_us\": " << now.wall_us << ", \"cpu_us\": " << now.cpu_us
+        << ", \"peak_rss_kb\": " << Usage().ru_maxrss << "}\n}\n";
+}
+
+void Profiler::WriteChromeTrace(std::ostream &out) const {
+    std::lock_guard lock(mutex_);
+    out << std::fixed << std::setprecision(OUTPUT_PRECISION) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (size_t k = 0; k < records_.size(); ++k) {
+        const ProfileRecord &record = records_[k];
+        out << (k == 0 ? "\n" : ",\n") << "  {\"name\": \"" << record.name << "\", \"cat\": \"" << record.category
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << record.thread << ", \"ts\": " << record.start_us
+            << ", \"dur\": " << record.wall_us << ", \"args\": {";
+        WriteRecordFields(out, record);
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
+
+ProfileScope::ProfileScope(const std::string &name, const std::string &category, size_t bytes)
+    : enabled_(Profiler::Global().Enabled()), bytes_(bytes) {
+    if (enabled_) {
+        name_ = name;
+        category_ = category;
+        start_ = ProfileSample::Now();
+    }
+}
+
+ProfileScope::~ProfileScope() {
+    if (enabled_) {
+        Profiler::Global().Record(name_, category_, start_, bytes_);
+    }
+}
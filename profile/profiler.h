@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Wall clock since the start of the process and CPU time of the whole process (all threads), in microseconds.
+struct ProfileSample {
+    double wall_us = 0;
+    double cpu_us = 0;
+
+    static ProfileSample Now();
+};
+
+struct ProfileRecord {
+    std::string name;
+    std::string category;
+    size_t thread = 0;
+    double start_us = 0;
+    double wall_us = 0;
+    double cpu_us = 0;
+    size_t bytes = 0;
+    size_t peak_rss_kb = 0;
+};
+
+// Collects timings of pipeline stages. Disabled by default: then scopes only check a flag, so
+// instrumented code costs nothing measurable. Records may come from several threads at once.
+class Profiler {
+public:
+    static Profiler &Global();
+
+    void Enable() {
+        enabled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Records a stage that started at start and ends now; bytes is the amount of pixel or file data it touched.
+    void Record(const std::string &name, const std::string &category, const ProfileSample &start, size_t bytes);
+
+    // Every record, totals per stage name and process totals.
+    void WriteJSON(std::ostream &out) const;
+    // Trace Event Format, as loaded by chrome://tracing and Perfetto.
+    void WriteChromeTrace(std::ostream &out) const;
+
+private:
+    Profiler() = default;
+    size_t ThreadIndex(std::thread::id id);
+
+    std::atomic<bool> enabled_ = false;
+    mutable std::mutex mutex_;
+    std::vector<ProfileRecord> records_;
+    std::unordered_map<std::thread::id, size_t> threads_;
+};
+
+// Records the enclosing block as one stage when the global profiler is enabled.
+class ProfileScope {
+public:
+    ProfileScope(const std::string &name, const std::string &category, size_t bytes = 0);
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+    ~ProfileScope();
+
+    void SetBytes(size_t bytes) {
+        bytes_ = bytes;
+    }
+
+private:
+    bool enabled_;
+    std::string name_;
+    std::string category_;
+    size_t bytes_;
+    ProfileSample start_;
+};
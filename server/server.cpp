@@ -0,0 +1,198 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include "server.h"
+#include "../exceptions/exceptions.h"
+
+const int LISTEN_BACKLOG = 64;
+const size_t READ_CHUNK = 1 << 16;
+const char INLINE_INPUT = '@';
+
+// Buffered reads and whole writes over a connected socket.
+class Connection {
+public:
+    explicit Connection(int fd) : fd_(fd) {
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    ~Connection() {
+        close(fd_);
+    }
+
+    bool ReadLine(std::string &line) {
+        while (true) {
+            size_t end = buffer_.find('\n', pos_);
+            if (end != std::string::npos) {
+                line = buffer_.substr(pos_, end - pos_);
+                pos_ = end + 1;
+                return true;
+            }
+            if (!Fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool ReadBytes(size_t count, std::string &data) {
+        while (buffer_.size() - pos_ < count) {
+            if (!Fill()) {
+                return false;
+            }
+        }
+        data = buffer_.substr(pos_, count);
+        pos_ += count;
+        return true;
+    }
+
+    bool Write(const std::string &data) {
+        for (size_t done = 0; done < data.size();) {
+            ssize_t written = send(fd_, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (written <= 0) {
+                return false;
+            }
+            done += written;
+        }
+        return true;
+    }
+
+private:
+    bool Fill() {
+        buffer_.erase(0, pos_);
+        pos_ = 0;
+        size_t size = buffer_.size();
+        buffer_.resize(size + READ_CHUNK);
+        ssize_t got = read(fd_, buffer_.data() + size, READ_CHUNK);
+        buffer_.resize(size + std::max<ssize_t>(got, 0));
+        return got > 0;
+    }
+
+    int fd_;
+    std::string buffer_;
+    size_t pos_ = 0;
+};
+
+Server::Server(const std::string &socket_path, size_t workers, size_t max_queued, size_t max_connections,
+               JobHandler handler)
+    : socket_path_(socket_path), max_connections_(max_connections), handler_(std::move(handler)),
+      jobs_(max_queued) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path)) {
+        throw OptionExceptions(SOCKET_FAILED);
+    }
+    std::strcpy(address.sun_path, socket_path_.c_str());
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path_.c_str());
+    if (listener_ < 0 || bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener_, LISTEN_BACKLOG) != 0) {
+        if (listener_ >= 0) {
+            close(listener_);
+        }
+        throw OptionExceptions(SOCKET_FAILED);
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back([this] {
+            while (std::optional<std::packaged_task<std::string()>> job = jobs_.Pop()) {
+                (*job)();
+            }
+        });
+    }
+}
+
+Server::~Server() {
+    jobs_.Close();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+    close(listener_);
+    unlink(socket_path_.c_str());
+}
+
+void Server::Run() {
+    while (true) {
+        int connection = accept(listener_, nullptr, nullptr);
+        if (connection < 0) {
+            continue;
+        }
+        // Only this thread adds connections, so the count cannot grow past the limit between the check
+        // and the increment.
+        if (connections_ >= max_connections_) {
+            Connection(connection).Write("BUSY\n");
+            continue;
+        }
+        ++connections_;
+        // The server lives as long as the process, so connection threads are not joined.
+        std::thread([this, connection] {
+            Serve(connection);
+            --connections_;
+        }).detach();
+    }
+}
+
+std::string Server::RunJob(const ServerJob &job) {
+    auto start = std::chrono::steady_clock::now();
+    std::string output = handler_(job);
+    std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - start;
+    std::ostringstream response;
+    response << "OK " << latency.count();
+    if (job.output == "-") {
+        response << ' ' << output.size() << '\n' << output;
+    } else {
+        response << '\n';
+    }
+    return response.str();
+}
+
+void Server::Serve(int fd) {
+    Connection connection(fd);
+    std::string line;
+    while (connection.ReadLine(line)) {
+        ServerJob job;
+        std::istringstream tokens(line);
+        std::string input;
+        tokens >> std::quoted(input) >> std::quoted(job.output);
+        for (std::string arg; tokens >> std::quoted(arg);) {
+            job.args.push_back(arg);
+        }
+        if (!input.empty() && input[0] == INLINE_INPUT) {
+            size_t size = 0;
+            try {
+                size = std::stoul(input.substr(1));
+            } catch (const std::exception &) {
+                connection.Write("ERROR " + INVALID_OPTIONS + "\n");
+                return;
+            }
+            if (!connection.ReadBytes(size, job.data)) {
+                return;
+            }
+        } else {
+            job.input = input;
+        }
+
+        std::string response;
+        if (job.output.empty()) {
+            response = "ERROR " + EMPTY_OUTPUT_FILE + "\n";
+        } else {
+            std::packaged_task<std::string()> task([this, &job] { return RunJob(job); });
+            std::future<std::string> result = task.get_future();
+            if (!jobs_.TryPush(std::move(task))) {
+                response = "BUSY\n";
+            } else {
+                try {
+                    response = result.get();
+                } catch (const std::exception &e) {
+                    response = "ERROR " + std::string(e.what()) + "\n";
+                }
+            }
+        }
+        if (!connection.Write(response)) {
+            return;
+        }
+    }
+}
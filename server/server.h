@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../parallel/bounded_queue.h"
+
+struct ServerJob {
+    // Path of the input image; empty when the image came inline in data.
+    std::string input;
+    std::string data;
+    // Path of the output image, or "-" to send it back over the connection.
+    std::string output;
+    std::vector<std::string> args;
+};
+
+// Runs one job and returns the output image when job.output is "-".
+using JobHandler = std::function<std::string(const ServerJob &)>;
+
+// Serves jobs over a Unix domain socket. Every connection sends requests of the form
+//     <input> <output> [filter args...]\n
+// where <input> is a path or @N followed by N bytes of BMP data right after the newline, and <output>
+// is a path or "-". Words are separated by spaces; a word with spaces is put in double quotes, with
+// \" and \\ standing for a quote and a backslash inside them. Each request gets one response line:
+//     OK <milliseconds>\n            the output was written to the path
+//     OK <milliseconds> <N>\n        followed by N bytes of BMP data, for "-"
+//     ERROR <message>\n
+//     BUSY\n                          max_queued jobs are already waiting; try again later
+// Jobs run on worker threads, taken from a queue of at most max_queued jobs, and spread their bands over
+// the global thread pool, which they share; image buffers stay warm in the buffer pool between jobs.
+// A connection only reads requests and waits for their results. Past max_connections open connections a
+// new one gets BUSY and is closed at once.
+class Server {
+public:
+    Server(const std::string &socket_path, size_t workers, size_t max_queued, size_t max_connections,
+           JobHandler handler);
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+    ~Server();
+
+    // Accepts connections until the process is stopped.
+    [[noreturn]] void Run();
+
+private:
+    void Serve(int connection);
+    std::string RunJob(const ServerJob &job);
+
+    std::string socket_path_;
+    size_t max_connections_;
+    JobHandler handler_;
+    int listener_ = -1;
+    std::atomic<size_t> connections_ = 0;
+    BoundedQueue<std::packaged_task<std::string()>> jobs_;
+    std::vector<std::thread> workers_;
+};
@@ -0,0 +1,553 @@
+#include <array>
+#include <cmath>
+#include "kernels.h"
+
+#if !defined(IMAGE_PROCESSOR_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_PROCESSOR_AVX2
+#include <immintrin.h>
+#endif
+
+const float GRAY_RED = static_cast<float>(RED_COF);
+const float GRAY_GREEN = static_cast<float>(GREEN_COF);
+const float GRAY_BLUE = static_cast<float>(BLUE_COF);
+// 8-bit grayscale works in 1.15 fixed point; the weights sum up to exactly 1 << GRAY_SHIFT.
+const uint32_t GRAY_SHIFT = 15;
+const uint32_t GRAY_RED_FIXED = 9798;
+const uint32_t GRAY_GREEN_FIXED = 19235;
+const uint32_t GRAY_BLUE_FIXED = 3735;
+const uint32_t GRAY_ROUNDING = 1u << (GRAY_SHIFT - 1);
+
+void NegateF32Scalar(float *data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        data[i] = 1.0f - data[i];
+    }
+}
+
+void NegateU8Scalar(uint8_t *data, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        data[i] = UINT8_MAX - data[i];
+    }
+}
+
+void GrayScaleF32Scalar(Pixel *row, size_t width) {
+    for (size_t j = 0; j < width; ++j) {
+        float red = GRAY_RED * row[j].red;
+        float green = GRAY_GREEN * row[j].green;
+        float blue = GRAY_BLUE * row[j].blue;
+        float color = red + green + blue;
+        row[j] = Pixel(color, color, color);
+    }
+}
+
+uint8_t GrayFixed(uint32_t red, uint32_t green, uint32_t blue) {
+    return static_cast<uint8_t>(
+        (GRAY_RED_FIXED * red + GRAY_GREEN_FIXED * green + GRAY_BLUE_FIXED * blue + GRAY_ROUNDING) >> GRAY_SHIFT);
+}
+
+void GrayScaleU8Scalar(Pixel8 *row, size_t width) {
+    for (size_t j = 0; j < width; ++j) {
+        uint8_t color = GrayFixed(row[j].red, row[j].green, row[j].blue);
+        row[j] = {color, color, color};
+    }
+}
+
+using ColorWeights = std::array<float, 12>;
+
+ColorWeights ToFloatWeights(const ColorMatrix &matrix) {
+    ColorWeights res = {};
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            res[i * 4 + j] = static_cast<float>(matrix.weights[i][j]);
+        }
+    }
+    return res;
+}
+
+float Combine(const float *w, float red, float green, float blue) {
+    float res = w[0] * red;
+    res = res + w[1] * green;
+    res = res + w[2] * blue;
+    return res + w[3];
+}
+
+void ColorMatrixF32Scalar(Pixel *row, size_t width, const ColorWeights &w) {
+    for (size_t j = 0; j < width; ++j) {
+        Pixel p = row[j];
+        row[j] = Pixel(Combine(&w[0], p.red, p.green, p.blue), Combine(&w[4], p.red, p.green, p.blue),
+                       Combine(&w[8], p.red, p.green, p.blue));
+    }
+}
+
+void ThresholdF32Scalar(Pixel *row, size_t width, float threshold) {
+    for (size_t j = 0; j < width; ++j) {
+        row[j] = row[j].red > threshold ? Pixel::White() : Pixel::Black();
+    }
+}
+
+void SplitChannelsF32Scalar(const Pixel *row, size_t width, float *red, float *green, float *blue) {
+    for (size_t j = 0; j < width; ++j) {
+        red[j] = row[j].red;
+        green[j] = row[j].green;
+        blue[j] = row[j].blue;
+    }
+}
+
+void MergeChannelsF32Scalar(Pixel *row, size_t width, const float *red, const float *green, const float *blue) {
+    for (size_t j = 0; j < width; ++j) {
+        row[j] = Pixel(red[j], green[j], blue[j]);
+    }
+}
+
+void MixF32Scalar(float *dst, const float *own, const float *other, size_t count, float weight, float scale) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (own[i] + weight * other[i]) * scale;
+    }
+}
+
+void AccumulateF32Scalar(float *dst, const float *src, size_t count, float weight) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] += weight * src[i];
+    }
+}
+
+void ResampleRowF32Scalar(float *dst, const float *src, size_t lanes, const size_t *first, const float *weights,
+                          size_t taps, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        const float *in = src + first[k] * lanes;
+        const float *w = weights + k * taps;
+        for (size_t c = 0; c < lanes; ++c) {
+            float sum = 0;
+            for (size_t t = 0; t < taps; ++t) {
+                sum += w[t] * in[t * lanes + c];
+            }
+            dst[k * lanes + c] = sum;
+        }
+    }
+}
+
+float LoadOperand(const RowOperand &operand, size_t i) {
+    return operand.row ? operand.row[i] : operand.value;
+}
+
+template <RowOp Op>
+float CombineScalar(float a, float b) {
+    if constexpr (Op == RowOp::ADD) {
+        return a + b;
+    } else if constexpr (Op == RowOp::SUB) {
+        return a - b;
+    } else if constexpr (Op == RowOp::MUL) {
+        return a * b;
+    } else if constexpr (Op == RowOp::DIV) {
+        return a / b;
+    } else if constexpr (Op == RowOp::MIN) {
+        // Same operand order as minps and maxps, so NaNs come out the same way.
+        return a < b ? a : b;
+    } else if constexpr (Op == RowOp::MAX) {
+        return a > b ? a : b;
+    } else if constexpr (Op == RowOp::LESS) {
+        return a < b ? 1.0f : 0.0f;
+    } else if constexpr (Op == RowOp::GREATER) {
+        return a > b ? 1.0f : 0.0f;
+    } else if constexpr (Op == RowOp::NEG) {
+        return -a;
+    } else if constexpr (Op == RowOp::ABS) {
+        return std::fabs(a);
+    } else if constexpr (Op == RowOp::SQRT) {
+        return std::sqrt(a);
+    } else {
+        return a;
+    }
+}
+
+template <RowOp Op>
+void MapRowScalar(float *dst, RowOperand a, RowOperand b, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = CombineScalar<Op>(LoadOperand(a, i), LoadOperand(b, i));
+    }
+}
+
+// Calls Map<Op>(args...) for the RowOp given at run time.
+#define SWITCH_ROW_OP(op, Map, ...)              \
+    switch (op) {                                \
+        case RowOp::ADD:                         \
+            Map<RowOp::ADD>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::SUB:                         \
+            Map<RowOp::SUB>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::MUL:                         \
+            Map<RowOp::MUL>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::DIV:                         \
+            Map<RowOp::DIV>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::MIN:                         \
+            Map<RowOp::MIN>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::MAX:                         \
+            Map<RowOp::MAX>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::LESS:                        \
+            Map<RowOp::LESS>(__VA_ARGS__);       \
+            break;                               \
+        case RowOp::GREATER:                     \
+            Map<RowOp::GREATER>(__VA_ARGS__);    \
+            break;                               \
+        case RowOp::NEG:                         \
+            Map<RowOp::NEG>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::ABS:                         \
+            Map<RowOp::ABS>(__VA_ARGS__);        \
+            break;                               \
+        case RowOp::SQRT:                        \
+            Map<RowOp::SQRT>(__VA_ARGS__);       \
+            break;                               \
+        case RowOp::COPY:                        \
+            Map<RowOp::COPY>(__VA_ARGS__);       \
+            break;                               \
+    }
+
+void RowOpF32Scalar(RowOp op, float *dst, RowOperand a, RowOperand b, size_t count) {
+    SWITCH_ROW_OP(op, MapRowScalar, dst, a, b, count);
+}
+
+#ifdef IMAGE_PROCESSOR_AVX2
+
+// Packed pixels are handled eight at a time: three vectors of 32-bit lanes are split into channel
+// planes with lane permutes and blends, and a plane is spread back over three vectors the same way.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 void DeinterleaveRGB(__m256 a, __m256 b, __m256 c, __m256 &first, __m256 &second, __m256 &third) {
+    const __m256i first_index = _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5);
+    const __m256i second_index = _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6);
+    const __m256i third_index = _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7);
+    first = _mm256_blend_ps(_mm256_permutevar8x32_ps(a, first_index), _mm256_permutevar8x32_ps(b, first_index),
+                            0b00111000);
+    first = _mm256_blend_ps(first, _mm256_permutevar8x32_ps(c, first_index), 0b11000000);
+    second = _mm256_blend_ps(_mm256_permutevar8x32_ps(a, second_index), _mm256_permutevar8x32_ps(b, second_index),
+                             0b00011000);
+    second = _mm256_blend_ps(second, _mm256_permutevar8x32_ps(c, second_index), 0b11100000);
+    third = _mm256_blend_ps(_mm256_permutevar8x32_ps(a, third_index), _mm256_permutevar8x32_ps(b, third_index),
+                            0b00011100);
+    third = _mm256_blend_ps(third, _mm256_permutevar8x32_ps(c, third_index), 0b11100000);
+}
+
+AVX2 void StoreReplicated(float *dst, __m256 value) {
+    const __m256i first = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+    const __m256i second = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+    const __m256i third = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+    _mm256_storeu_ps(dst, _mm256_permutevar8x32_ps(value, first));
+    _mm256_storeu_ps(dst + 8, _mm256_permutevar8x32_ps(value, second));
+    _mm256_storeu_ps(dst + 16, _mm256_permutevar8x32_ps(value, third));
+}
+
+AVX2 void StoreInterleaved(float *dst, __m256 first, __m256 second, __m256 third) {
+    const __m256i first_pixels = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+    const __m256i second_pixels = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+    const __m256i third_pixels = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+    __m256 res = _mm256_permutevar8x32_ps(first, first_pixels);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(second, first_pixels), 0b10010010);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(third, first_pixels), 0b00100100);
+    _mm256_storeu_ps(dst, res);
+    res = _mm256_permutevar8x32_ps(first, second_pixels);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(second, second_pixels), 0b00100100);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(third, second_pixels), 0b01001001);
+    _mm256_storeu_ps(dst + 8, res);
+    res = _mm256_permutevar8x32_ps(first, third_pixels);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(second, third_pixels), 0b01001001);
+    res = _mm256_blend_ps(res, _mm256_permutevar8x32_ps(third, third_pixels), 0b10010010);
+    _mm256_storeu_ps(dst + 16, res);
+}
+
+AVX2 void NegateF32Avx2(float *data, size_t count) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(data + i, _mm256_sub_ps(one, _mm256_loadu_ps(data + i)));
+    }
+    NegateF32Scalar(data + i, count - i);
+}
+
+AVX2 void NegateU8Avx2(uint8_t *data, size_t count) {
+    const __m256i ones = _mm256_set1_epi8(static_cast<char>(UINT8_MAX));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i *ptr = reinterpret_cast<__m256i *>(data + i);
+        _mm256_storeu_si256(ptr, _mm256_xor_si256(_mm256_loadu_si256(ptr), ones));
+    }
+    NegateU8Scalar(data + i, count - i);
+}
+
+AVX2 void GrayScaleF32Avx2(Pixel *row, size_t width) {
+    const __m256 red_cof = _mm256_set1_ps(GRAY_RED);
+    const __m256 green_cof = _mm256_set1_ps(GRAY_GREEN);
+    const __m256 blue_cof = _mm256_set1_ps(GRAY_BLUE);
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        float *data = &row[j].red;
+        __m256 red;
+        __m256 green;
+        __m256 blue;
+        DeinterleaveRGB(_mm256_loadu_ps(data), _mm256_loadu_ps(data + 8), _mm256_loadu_ps(data + 16), red, green,
+                        blue);
+        __m256 color = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(red_cof, red), _mm256_mul_ps(green_cof, green)),
+                                     _mm256_mul_ps(blue_cof, blue));
+        StoreReplicated(data, color);
+    }
+    GrayScaleF32Scalar(row + j, width - j);
+}
+
+AVX2 void GrayScaleU8Avx2(Pixel8 *row, size_t width) {
+    const __m256i red_cof = _mm256_set1_epi32(GRAY_RED_FIXED);
+    const __m256i green_cof = _mm256_set1_epi32(GRAY_GREEN_FIXED);
+    const __m256i blue_cof = _mm256_set1_epi32(GRAY_BLUE_FIXED);
+    const __m256i rounding = _mm256_set1_epi32(GRAY_ROUNDING);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    const __m128i spread_low = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i spread_high = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        uint8_t *data = &row[j].blue;
+        __m256 a = _mm256_castsi256_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i *>(data))));
+        __m256 b = _mm256_castsi256_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i *>(data + 8))));
+        __m256 c = _mm256_castsi256_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i *>(data + 16))));
+        __m256 blue;
+        __m256 green;
+        __m256 red;
+        DeinterleaveRGB(a, b, c, blue, green, red);
+        __m256i sum = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_castps_si256(red), red_cof), rounding);
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_castps_si256(green), green_cof));
+        sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(_mm256_castps_si256(blue), blue_cof));
+        __m256i color = _mm256_srli_epi32(sum, GRAY_SHIFT);
+        color = _mm256_packus_epi32(color, color);
+        color = _mm256_packus_epi16(color, color);
+        __m128i bytes = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(color, gather));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data), _mm_shuffle_epi8(bytes, spread_low));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(data + 16), _mm_shuffle_epi8(bytes, spread_high));
+    }
+    GrayScaleU8Scalar(row + j, width - j);
+}
+
+AVX2 __m256 CombineAvx2(const float *w, __m256 red, __m256 green, __m256 blue) {
+    __m256 res = _mm256_mul_ps(_mm256_set1_ps(w[0]), red);
+    res = _mm256_add_ps(res, _mm256_mul_ps(_mm256_set1_ps(w[1]), green));
+    res = _mm256_add_ps(res, _mm256_mul_ps(_mm256_set1_ps(w[2]), blue));
+    return _mm256_add_ps(res, _mm256_set1_ps(w[3]));
+}
+
+AVX2 void ColorMatrixF32Avx2(Pixel *row, size_t width, const ColorWeights &w) {
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        float *data = &row[j].red;
+        __m256 red;
+        __m256 green;
+        __m256 blue;
+        DeinterleaveRGB(_mm256_loadu_ps(data), _mm256_loadu_ps(data + 8), _mm256_loadu_ps(data + 16), red, green,
+                        blue);
+        StoreInterleaved(data, CombineAvx2(&w[0], red, green, blue), CombineAvx2(&w[4], red, green, blue),
+                         CombineAvx2(&w[8], red, green, blue));
+    }
+    ColorMatrixF32Scalar(row + j, width - j, w);
+}
+
+AVX2 void ThresholdF32Avx2(Pixel *row, size_t width, float threshold) {
+    const __m256 limit = _mm256_set1_ps(threshold);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        float *data = &row[j].red;
+        __m256 red;
+        __m256 green;
+        __m256 blue;
+        DeinterleaveRGB(_mm256_loadu_ps(data), _mm256_loadu_ps(data + 8), _mm256_loadu_ps(data + 16), red, green,
+                        blue);
+        StoreReplicated(data, _mm256_and_ps(_mm256_cmp_ps(red, limit, _CMP_GT_OQ), one));
+    }
+    ThresholdF32Scalar(row + j, width - j, threshold);
+}
+
+AVX2 void SplitChannelsF32Avx2(const Pixel *row, size_t width, float *red, float *green, float *blue) {
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const float *data = &row[j].red;
+        __m256 first;
+        __m256 second;
+        __m256 third;
+        DeinterleaveRGB(_mm256_loadu_ps(data), _mm256_loadu_ps(data + 8), _mm256_loadu_ps(data + 16), first, second,
+                        third);
+        _mm256_storeu_ps(red + j, first);
+        _mm256_storeu_ps(green + j, second);
+        _mm256_storeu_ps(blue + j, third);
+    }
+    SplitChannelsF32Scalar(row + j, width - j, red + j, green + j, blue + j);
+}
+
+AVX2 void MergeChannelsF32Avx2(Pixel *row, size_t width, const float *red, const float *green, const float *blue) {
+    size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        StoreInterleaved(&row[j].red, _mm256_loadu_ps(red + j), _mm256_loadu_ps(green + j),
+                         _mm256_loadu_ps(blue + j));
+    }
+    MergeChannelsF32Scalar(row + j, width - j, red + j, green + j, blue + j);
+}
+
+AVX2 void MixF32Avx2(float *dst, const float *own, const float *other, size_t count, float weight, float scale) {
+    const __m256 weights = _mm256_set1_ps(weight);
+    const __m256 scales = _mm256_set1_ps(scale);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(own + i), _mm256_mul_ps(weights, _mm256_loadu_ps(other + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(sum, scales));
+    }
+    MixF32Scalar(dst + i, own + i, other + i, count - i, weight, scale);
+}
+
+AVX2 void AccumulateF32Avx2(float *dst, const float *src, size_t count, float weight) {
+    const __m256 weights = _mm256_set1_ps(weight);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(weights, _mm256_loadu_ps(src + i)));
+        _mm256_storeu_ps(dst + i, sum);
+    }
+    AccumulateF32Scalar(dst + i, src + i, count - i, weight);
+}
+
+// A pixel of up to four lanes is one masked vector, so every tap costs a single multiply and add.
+AVX2 void ResampleRowF32Avx2(float *dst, const float *src, size_t lanes, const size_t *first, const float *weights,
+                             size_t taps, size_t count) {
+    if (lanes > 4) {
+        ResampleRowF32Scalar(dst, src, lanes, first, weights, taps, count);
+        return;
+    }
+    const __m128i mask = _mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int>(lanes)), _mm_setr_epi32(0, 1, 2, 3));
+    for (size_t k = 0; k < count; ++k) {
+        const float *in = src + first[k] * lanes;
+        const float *w = weights + k * taps;
+        __m128 sum = _mm_setzero_ps();
+        for (size_t t = 0; t < taps; ++t) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(w[t]), _mm_maskload_ps(in + t * lanes, mask)));
+        }
+        _mm_maskstore_ps(dst + k * lanes, mask, sum);
+    }
+}
+
+AVX2 __m256 LoadOperandAvx2(const RowOperand &operand, size_t i) {
+    return operand.row ? _mm256_loadu_ps(operand.row + i) : _mm256_set1_ps(operand.value);
+}
+
+template <RowOp Op>
+AVX2 __m256 CombineAvx2(__m256 a, __m256 b) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    if constexpr (Op == RowOp::ADD) {
+        return _mm256_add_ps(a, b);
+    } else if constexpr (Op == RowOp::SUB) {
+        return _mm256_sub_ps(a, b);
+    } else if constexpr (Op == RowOp::MUL) {
+        return _mm256_mul_ps(a, b);
+    } else if constexpr (Op == RowOp::DIV) {
+        return _mm256_div_ps(a, b);
+    } else if constexpr (Op == RowOp::MIN) {
+        return _mm256_min_ps(a, b);
+    } else if constexpr (Op == RowOp::MAX) {
+        return _mm256_max_ps(a, b);
+    } else if constexpr (Op == RowOp::LESS) {
+        return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), _mm256_set1_ps(1.0f));
+    } else if constexpr (Op == RowOp::GREATER) {
+        return _mm256_and_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ), _mm256_set1_ps(1.0f));
+    } else if constexpr (Op == RowOp::NEG) {
+        return _mm256_xor_ps(a, sign);
+    } else if constexpr (Op == RowOp::ABS) {
+        return _mm256_andnot_ps(sign, a);
+    } else if constexpr (Op == RowOp::SQRT) {
+        return _mm256_sqrt_ps(a);
+    } else {
+        return a;
+    }
+}
+
+template <RowOp Op>
+AVX2 void MapRowAvx2(float *dst, RowOperand a, RowOperand b, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, CombineAvx2<Op>(LoadOperandAvx2(a, i), LoadOperandAvx2(b, i)));
+    }
+    RowOperand a_tail = {a.row ? a.row + i : nullptr, a.value};
+    RowOperand b_tail = {b.row ? b.row + i : nullptr, b.value};
+    MapRowScalar<Op>(dst + i, a_tail, b_tail, count - i);
+}
+
+AVX2 void RowOpF32Avx2(RowOp op, float *dst, RowOperand a, RowOperand b, size_t count) {
+    SWITCH_ROW_OP(op, MapRowAvx2, dst, a, b, count);
+}
+
+#undef AVX2
+
+bool SimdAvailable() {
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+
+#define DISPATCH(name, ...)                                           \
+    static const auto impl = SimdAvailable() ? name##Avx2 : name##Scalar; \
+    impl(__VA_ARGS__)
+
+#else
+
+bool SimdAvailable() {
+    return false;
+}
+
+#define DISPATCH(name, ...) name##Scalar(__VA_ARGS__)
+
+#endif
+
+void NegateF32(float *data, size_t count) {
+    DISPATCH(NegateF32, data, count);
+}
+
+void NegateU8(uint8_t *data, size_t count) {
+    DISPATCH(NegateU8, data, count);
+}
+
+void GrayScaleF32(Pixel *row, size_t width) {
+    DISPATCH(GrayScaleF32, row, width);
+}
+
+void GrayScaleU8(Pixel8 *row, size_t width) {
+    DISPATCH(GrayScaleU8, row, width);
+}
+
+void ColorMatrixF32(Pixel *row, size_t width, const ColorMatrix &matrix) {
+    ColorWeights weights = ToFloatWeights(matrix);
+    DISPATCH(ColorMatrixF32, row, width, weights);
+}
+
+void ThresholdF32(Pixel *row, size_t width, float threshold) {
+    DISPATCH(ThresholdF32, row, width, threshold);
+}
+
+void SplitChannelsF32(const Pixel *row, size_t width, float *red, float *green, float *blue) {
+    DISPATCH(SplitChannelsF32, row, width, red, green, blue);
+}
+
+void MergeChannelsF32(Pixel *row, size_t width, const float *red, const float *green, const float *blue) {
+    DISPATCH(MergeChannelsF32, row, width, red, green, blue);
+}
+
+void MixF32(float *dst, const float *own, const float *other, size_t count, float weight) {
+    float scale = 1.0f / (1.0f + weight);
+    DISPATCH(MixF32, dst, own, other, count, weight, scale);
+}
+
+void AccumulateF32(float *dst, const float *src, size_t count, float weight) {
+    DISPATCH(AccumulateF32, dst, src, count, weight);
+}
+
+void ResampleRowF32(float *dst, const float *src, size_t lanes, const size_t *first, const float *weights,
+                    size_t taps, size_t count) {
+    DISPATCH(ResampleRowF32, dst, src, lanes, first, weights, taps, count);
+}
+
+void RowOpF32(RowOp op, float *dst, RowOperand a, RowOperand b, size_t count) {
+    DISPATCH(RowOpF32, op, dst, a, b, count);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "../graphics/graphics.h"
+
+// Row kernels for point-wise filters. Each call is dispatched once, at first use, to an AVX2
+// implementation when the CPU supports it and to a portable scalar one otherwise; both give
+// bit-identical results.
+
+bool SimdAvailable();
+
+void NegateF32(float *data, size_t count);
+void NegateU8(uint8_t *data, size_t count);
+void GrayScaleF32(Pixel *row, size_t width);
+void GrayScaleU8(Pixel8 *row, size_t width);
+void ColorMatrixF32(Pixel *row, size_t width, const ColorMatrix &matrix);
+// Paints a pixel white when its red channel exceeds threshold and black otherwise.
+void ThresholdF32(Pixel *row, size_t width, float threshold);
+// Splits a row into channel planes and joins it back.
+void SplitChannelsF32(const Pixel *row, size_t width, float *red, float *green, float *blue);
+void MergeChannelsF32(Pixel *row, size_t width, const float *red, const float *green, const float *blue);
+// dst[i] = (own[i] + weight * other[i]) / (1 + weight).
+void MixF32(float *dst, const float *own, const float *other, size_t count, float weight);
+
+// dst[i] += weight * src[i].
+void AccumulateF32(float *dst, const float *src, size_t count, float weight);
+// Resamples a row of pixels of lanes floats each: pixel k of dst is the sum of the taps pixels of src from
+// first[k] on, weighted by weights[k * taps] and on.
+void ResampleRowF32(float *dst, const float *src, size_t lanes, const size_t *first, const float *weights,
+                    size_t taps, size_t count);
+
+// Element-wise operations on rows of floats, the instructions of PixelExpression. Unary ones ignore b.
+enum class RowOp { ADD, SUB, MUL, DIV, MIN, MAX, LESS, GREATER, NEG, ABS, SQRT, COPY };
+
+// Operand of RowOpF32: count values of row, or value repeated when row is null.
+struct RowOperand {
+    const float *row;
+    float value;
+};
+
+// dst may be one of the operand rows.
+void RowOpF32(RowOp op, float *dst, RowOperand a, RowOperand b, size_t count);
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <deque>
+#include "stream.h"
+#include "../parallel/bounded_queue.h"
+#include "../parallel/io_thread.h"
+
+const size_t STREAM_BAND_ROWS = 64;
+const size_t IO_BLOCK_ROWS = 64;
+// Blocks waiting between the I/O threads and the stages, on each side.
+const size_t IO_BUFFERS = 3;
+
+struct StreamStage {
+    Filter *filter = nullptr;
+    size_t halo = 0;
+    size_t in_height = 0;
+    size_t out_width = 0;
+    // Rows of input and output the rest of the chain actually uses; crops later on make them smaller.
+    size_t needed_in = 0;
+    size_t needed_out = 0;
+    size_t band = 0;
+    // Input rows [first, first + rows.size()) that are still needed.
+    std::deque<std::vector<Pixel>> rows;
+    size_t first = 0;
+    size_t produced = 0;
+};
+
+// Collects output rows into blocks, which an I/O thread encodes and writes while the next ones are computed.
+class StreamWriter {
+public:
+    StreamWriter(BMP &bmp, std::ostream &output, size_t width)
+        : bmp_(bmp), output_(output), width_(width), blocks_(IO_BUFFERS), thread_([this] { WriteBlocks(); }) {
+    }
+
+    ~StreamWriter() {
+        blocks_.Close();
+    }
+
+    void Push(const Pixel *row) {
+        if (block_.Empty()) {
+            block_ = Image(width_, IO_BLOCK_ROWS, PixelFormat::RGBF32);
+            filled_ = 0;
+        }
+        std::copy(row, row + width_, block_.Row(filled_++));
+        if (filled_ == IO_BLOCK_ROWS) {
+            Flush();
+        }
+    }
+
+    // Writes the rows pushed so far and waits until everything is written.
+    void Finish() {
+        Flush();
+        blocks_.Close();
+        thread_.Join();
+    }
+
+private:
+    struct Block {
+        size_t begin;
+        Image image;
+    };
+
+    void Flush() {
+        if (block_.Empty() || filled_ == 0) {
+            return;
+        }
+        block_.Crop(width_, filled_);
+        // The queue closes early only when a write fails, and Join rethrows that failure.
+        if (!blocks_.Push({written_, std::move(block_)})) {
+            thread_.Join();
+        }
+        written_ += filled_;
+        block_ = Image();
+    }
+
+    void WriteBlocks() {
+        try {
+            while (std::optional<Block> block = blocks_.Pop()) {
+                bmp_.WriteRows(output_, block->begin, block->image);
+            }
+        } catch (...) {
+            blocks_.Close();
+            throw;
+        }
+    }
+
+    BMP &bmp_;
+    std::ostream &output_;
+    size_t width_;
+    Image block_;
+    size_t filled_ = 0;
+    size_t written_ = 0;
+    BoundedQueue<Block> blocks_;
+    IoThread thread_;
+};
+
+class StreamEngine {
+public:
+    StreamEngine(std::vector<StreamStage> &stages, StreamWriter &writer) : stages_(stages), writer_(writer) {
+    }
+
+    void Push(size_t k, const Pixel *row, size_t width) {
+        if (k == stages_.size()) {
+            writer_.Push(row);
+            return;
+        }
+        StreamStage &stage = stages_[k];
+        stage.rows.emplace_back(row, row + width);
+        Drain(k, width);
+    }
+
+private:
+    void Drain(size_t k, size_t width) {
+        StreamStage &stage = stages_[k];
+        while (stage.produced < stage.needed_out) {
+            size_t begin = stage.produced;
+            size_t end = std::min(begin + stage.band, stage.needed_out);
+            size_t received = stage.first + stage.rows.size();
+            if (received < std::min(end + stage.halo, stage.in_height)) {
+                return;
+            }
+            // The band is padded by the halo on both sides; past the image edges the edge rows repeat,
+            // which is exactly what the filters do on a whole image.
+            BMP band;
+            band.image = Image(width, end - begin + 2 * stage.halo, PixelFormat::RGBF32);
+            for (size_t i = 0; i < band.image.Height(); ++i) {
+                ptrdiff_t x = static_cast<ptrdiff_t>(begin + i) - static_cast<ptrdiff_t>(stage.halo);
+                size_t source = std::clamp<ptrdiff_t>(x, 0, static_cast<ptrdiff_t>(stage.in_height) - 1);
+                const std::vector<Pixel> &row = stage.rows[source - stage.first];
+                std::copy(row.begin(), row.end(), band.image.Row(i));
+            }
+            stage.filter->Apply(band);
+            band.image.ConvertTo(PixelFormat::RGBF32);
+            stage.produced = end;
+            size_t keep_from = end > stage.halo ? end - stage.halo : 0;
+            while (stage.first < keep_from && !stage.rows.empty()) {
+                stage.rows.pop_front();
+                ++stage.first;
+            }
+            for (size_t i = begin; i < end; ++i) {
+                Push(k + 1, band.image.Row(i - begin + stage.halo), band.image.Width());
+            }
+        }
+    }
+
+    std::vector<StreamStage> &stages_;
+    StreamWriter &writer_;
+};
+
+bool CanStream(const std::vector<std::unique_ptr<Filter>> &stages) {
+    return std::all_of(stages.begin(), stages.end(), [](const auto &f) { return f->GetHalo().rows != UNBOUNDED; });
+}
+
+void StreamBMP(std::istream &input, std::ostream &output, const std::vector<std::unique_ptr<Filter>> &chain) {
+    BMP source;
+    source.ReadHeaders(input);
+    size_t width = source.bmp_ih.bi_width;
+    size_t height = source.bmp_ih.bi_height;
+    // A leading crop also limits how much of every row is decoded.
+    size_t read_width = width;
+    if (const auto *crop = chain.empty() ? nullptr : dynamic_cast<const Crop *>(chain.front().get())) {
+        read_width = std::min(width, crop->Width());
+    }
+
+    std::vector<StreamStage> stages(chain.size());
+    size_t stage_width = read_width;
+    for (size_t k = 0; k < chain.size(); ++k) {
+        StreamStage &stage = stages[k];
+        stage.filter = chain[k].get();
+        stage.halo = chain[k]->GetHalo().rows;
+        stage.in_height = height;
+        stage.out_width = stage_width;
+        if (const auto *crop = dynamic_cast<const Crop *>(chain[k].get())) {
+            stage.out_width = std::min(stage_width, crop->Width());
+            height = std::min(height, crop->Height());
+        }
+        stage.band = std::max(STREAM_BAND_ROWS, 2 * stage.halo);
+        stage_width = stage.out_width;
+    }
+    size_t needed = height;
+    for (size_t k = stages.size(); k--;) {
+        stages[k].needed_out = needed;
+        stages[k].needed_in = std::min(stages[k].in_height, needed + stages[k].halo);
+        needed = stages[k].needed_in;
+    }
+
+    BMP target;
+    target.bmp_fh = source.bmp_fh;
+    target.bmp_ih = source.bmp_ih;
+    target.WriteHeaders(output, stage_width, height);
+    StreamWriter writer(target, output, stage_width);
+    StreamEngine engine(stages, writer);
+    // Blocks are decoded on an I/O thread, the next ones while the current one goes through the stages.
+    BoundedQueue<Image> blocks(IO_BUFFERS);
+    IoThread reader([&] {
+        try {
+            for (size_t done = 0; done < needed;) {
+                Image block(read_width, std::min(IO_BLOCK_ROWS, needed - done), PixelFormat::RGBF32);
+                source.ReadRows(input, done, block);
+                done += block.Height();
+                if (!blocks.Push(std::move(block))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            blocks.Close();
+            throw;
+        }
+        blocks.Close();
+    });
+    try {
+        while (std::optional<Image> block = blocks.Pop()) {
+            for (size_t i = 0; i < block->Height(); ++i) {
+                engine.Push(0, block->Row(i), read_width);
+            }
+        }
+    } catch (...) {
+        blocks.Close();
+        throw;
+    }
+    reader.Join();
+    writer.Finish();
+}
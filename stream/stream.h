@@ -0,0 +1,14 @@
+#pragma once
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "../filters/filters.h"
+
+// True when every stage reads a bounded number of rows around each output row.
+bool CanStream(const std::vector<std::unique_ptr<Filter>> &stages);
+
+// Runs the stages over the BMP in input band by band and writes the result to output as rows complete.
+// Each stage keeps only the input rows its next band still needs (the band plus its vertical halo), so
+// peak memory is O(width * (band + halo)) per stage rather than the whole image. output must be seekable.
+void StreamBMP(std::istream &input, std::ostream &output, const std::vector<std::unique_ptr<Filter>> &stages);
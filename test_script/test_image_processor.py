@@ -4,24 +4,34 @@ from collections import namedtuple
 from functools import reduce
 # from PIL import Image
 from PIL import Image, ImageChops, UnidentifiedImageError
+import json
 import math
 import operator
 import os
+import select
+import shutil
+import socket
 import subprocess
 import sys
 import tempfile
+import time
 
 
 def calc_images_distance(image_path1, image_path2):
     with Image.open(image_path1) as image1, Image.open(image_path2) as image2:
-        histogram = ImageChops.difference(image1, image2).histogram()
+        # paletted, gray and 32-bit files are compared by their colors (and alpha, if either has it)
+        mode = "RGBA" if "A" in image1.getbands() + image2.getbands() else "RGB"
+        histogram = ImageChops.difference(image1.convert(mode), image2.convert(mode)).histogram()
 
-        return math.sqrt(reduce(operator.add, map(lambda h, i: h * (i ** 2), histogram, range(256))) / (
-                float(image1.size[0]) * image1.size[1]))
+        # the histogram has 256 entries per band; the distance is the rms over the values of all bands
+        return math.sqrt(reduce(operator.add, map(lambda h, i: h * ((i % 256) ** 2), histogram,
+                                                  range(len(histogram)))) / (
+                float(image1.size[0]) * image1.size[1] * len(mode)))
 
 
 class ImageProcessorTester:
-    TestCase = namedtuple("TestCase", ["name", "input", "args", "eps"])
+    # expected names the fixture when it is not {input}_{name}.bmp, e.g. when two filters must give the same image
+    TestCase = namedtuple("TestCase", ["name", "input", "args", "eps", "expected"], defaults=[None])
 
     class TestCaseFailedException(Exception):
         pass
@@ -72,7 +82,128 @@ class ImageProcessorTester:
                 ImageProcessorTester.TestCase(input="lenna", name="blur", args=["-blur", "7.5"], eps=2.0),
                 ImageProcessorTester.TestCase(input="lenna", name="blur_blur", args=["-blur", "7.5", "-blur", "3"],
                                               eps=2.0),
+                ImageProcessorTester.TestCase(input="flag", name="blur", args=["-blur", "3"], eps=2.0),
+                ImageProcessorTester.TestCase(input="flag", name="blur_large", args=["-blur", "25"], eps=2.0),
             ],
+            "formats": [
+                ImageProcessorTester.TestCase(input="flag_rgb32", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag_bf10", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag_v4alpha", name="neg", args=["-neg"], eps=0.0),
+                ImageProcessorTester.TestCase(input="flag_pal8", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag_pal4", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag_gray8", name="neg", args=["-neg"], eps=0.0),
+                ImageProcessorTester.TestCase(input="flag_gray8", name="sharp", args=["-sharp"], eps=1.0),
+                ImageProcessorTester.TestCase(input="flag_gray8", name="gs_edge", args=["-gs", "-edge", "0.1"],
+                                              eps=0.0),
+            ],
+            "rle": [
+                ImageProcessorTester.TestCase(input="flag_rle8", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag_rle4", name="neg", args=["-neg"], eps=0.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="flag", name="rle", args=["-rle"], eps=0.0, expected="flag"),
+                ImageProcessorTester.TestCase(input="flag_rle8", name="rle", args=["-rle"], eps=0.0,
+                                              expected="flag"),
+            ],
+            "expr": [
+                ImageProcessorTester.TestCase(input="flag", name="expr", args=["-expr", "1 - r", "g * 0.5", "b"],
+                                              eps=0.0),
+                ImageProcessorTester.TestCase(input="flag", name="expr_clamp",
+                                              args=["-expr", "2 * r", "2 * g - 0.8", "sqrt(b - 2)",
+                                                    "-expr", "r / 2", "g / 2", "b + 0.5"], eps=0.0),
+                ImageProcessorTester.TestCase(input="flag", name="expr_xy",
+                                              args=["-expr", "x / w", "y / h", "r * (x < w / 2)"], eps=0.0),
+            ],
+            "resize": [
+                ImageProcessorTester.TestCase(input="flag", name="resize_down", args=["-resize", "4", "7"], eps=0.0),
+                ImageProcessorTester.TestCase(input="flag", name="resize_up", args=["-resize", "25", "45"], eps=1.0),
+                ImageProcessorTester.TestCase(input="flag", name="resize_sharp", args=["-resize", "25", "45", "-sharp"],
+                                              eps=1.0),
+            ],
+            # stripes is taller than a band of -stream, so band edges and halos are crossed
+            "stream": [
+                ImageProcessorTester.TestCase(input="flag", name="blur_stream", args=["-blur", "3", "-stream"],
+                                              eps=2.0, expected="flag_blur"),
+                ImageProcessorTester.TestCase(input="flag", name="blur_large_stream", args=["-blur", "25", "-stream"],
+                                              eps=2.0, expected="flag_blur_large"),
+                ImageProcessorTester.TestCase(input="flag", name="sharp_stream", args=["-sharp", "-stream"], eps=1.0,
+                                              expected="flag_sharp"),
+                ImageProcessorTester.TestCase(input="flag", name="edge_stream", args=["-edge", "0.1", "-stream"],
+                                              eps=1.0, expected="flag_edge"),
+                ImageProcessorTester.TestCase(input="stripes", name="blur", args=["-blur", "2"], eps=1.0),
+                ImageProcessorTester.TestCase(input="stripes", name="blur_stream", args=["-blur", "2", "-stream"],
+                                              eps=1.0, expected="stripes_blur"),
+                ImageProcessorTester.TestCase(input="stripes", name="blur_large", args=["-blur", "8"], eps=2.0),
+                ImageProcessorTester.TestCase(input="stripes", name="blur_large_stream", args=["-blur", "8", "-stream"],
+                                              eps=2.0, expected="stripes_blur_large"),
+                ImageProcessorTester.TestCase(input="stripes", name="sharp", args=["-sharp"], eps=1.0),
+                ImageProcessorTester.TestCase(input="stripes", name="sharp_stream", args=["-sharp", "-stream"], eps=1.0,
+                                              expected="stripes_sharp"),
+                ImageProcessorTester.TestCase(input="stripes", name="edge", args=["-edge", "0.1"], eps=0.0),
+                ImageProcessorTester.TestCase(input="stripes", name="edge_stream", args=["-edge", "0.1", "-stream"],
+                                              eps=0.0, expected="stripes_edge"),
+                ImageProcessorTester.TestCase(input="stripes", name="crop_edge",
+                                              args=["-crop", "30", "150", "-edge", "0.1"], eps=0.0),
+                ImageProcessorTester.TestCase(input="stripes", name="crop_edge_stream",
+                                              args=["-crop", "30", "150", "-edge", "0.1", "-stream"], eps=0.0,
+                                              expected="stripes_crop_edge"),
+                # y and h need the whole image, so -stream processes it whole
+                ImageProcessorTester.TestCase(input="stripes", name="expr",
+                                              args=["-expr", "r * (y < h / 2)", "g", "b * y / h"], eps=0.0),
+                ImageProcessorTester.TestCase(input="stripes", name="expr_stream",
+                                              args=["-expr", "r * (y < h / 2)", "g", "b * y / h", "-stream"], eps=0.0,
+                                              expected="stripes_expr"),
+            ],
+            "mmap": [
+                ImageProcessorTester.TestCase(input="flag", name="crop_mmap", args=["-crop", "50", "50", "-mmap"],
+                                              eps=0.0, expected="flag_crop"),
+                ImageProcessorTester.TestCase(input="flag", name="gs_mmap", args=["-gs", "-mmap"], eps=1.0,
+                                              expected="flag_gs"),
+                ImageProcessorTester.TestCase(input="flag", name="neg_mmap", args=["-neg", "-mmap"], eps=1.0,
+                                              expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="stripes", name="crop_mmap", args=["-crop", "30", "150", "-mmap"],
+                                              eps=0.0, expected="stripes_crop"),
+            ],
+            "threads": [
+                ImageProcessorTester.TestCase(input="flag", name="crop_threads1",
+                                              args=["-crop", "50", "50", "-threads", "1"], eps=0.0,
+                                              expected="flag_crop"),
+                ImageProcessorTester.TestCase(input="flag", name="gs_threads1",
+                                              args=["-gs", "-threads", "1"], eps=1.0, expected="flag_gs"),
+                ImageProcessorTester.TestCase(input="flag", name="neg_threads1",
+                                              args=["-neg", "-threads", "1"], eps=1.0, expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="stripes", name="blur_threads1",
+                                              args=["-blur", "2", "-threads", "1"], eps=1.0, expected="stripes_blur"),
+                ImageProcessorTester.TestCase(input="flag", name="crop_threads3",
+                                              args=["-crop", "50", "50", "-threads", "3"], eps=0.0,
+                                              expected="flag_crop"),
+                ImageProcessorTester.TestCase(input="flag", name="gs_threads3",
+                                              args=["-gs", "-threads", "3"], eps=1.0, expected="flag_gs"),
+                ImageProcessorTester.TestCase(input="flag", name="neg_threads3",
+                                              args=["-neg", "-threads", "3"], eps=1.0, expected="flag_neg"),
+                ImageProcessorTester.TestCase(input="stripes", name="blur_threads3",
+                                              args=["-blur", "2", "-threads", "3"], eps=1.0, expected="stripes_blur"),
+            ],
+            "conv": [
+                ImageProcessorTester.TestCase(input="flag", name="conv_sharp", args=["-conv", "0,-1,0,-1,5,-1,0,-1,0"],
+                                              eps=1.0, expected="flag_sharp"),
+                # separable 5x5 binomial kernel, (1 4 6 4 1) / 16 along both axes
+                ImageProcessorTester.TestCase(input="flag", name="conv_5x5",
+                                              args=["-conv", ",".join(str(a * b / 256) for a in (1, 4, 6, 4, 1)
+                                                                      for b in (1, 4, 6, 4, 1))],
+                                              eps=1.0),
+            ],
+        }
+        # modes that need more than one run of image_processor
+        mode_tests = {
+            "batch": self.run_batch_tests,
+            "branch": self.run_branch_tests,
+            "cache": self.run_cache_tests,
+            "serve": self.run_server_tests,
         }
         ok_filters = set()
 
@@ -83,6 +214,12 @@ class ImageProcessorTester:
                 ok_filters.add(filter_name)
             except ImageProcessorTester.TestCaseFailedException:
                 pass
+        for mode_name, run_mode_tests in mode_tests.items():
+            try:
+                run_mode_tests()
+                ok_filters.add(mode_name)
+            except ImageProcessorTester.TestCaseFailedException:
+                pass
 
         if ok_filters:
             print("-----\nTOTAL {ok_filters_count} OK FILTERS: {ok_filters}\n-----".format(
@@ -96,7 +233,8 @@ class ImageProcessorTester:
     def run_test_case(self, test_case):
         try:
             input_file_name = "{input}.bmp".format(input=test_case.input)
-            output_file_name = "./{input}_{name}.bmp".format(input=test_case.input, name=test_case.name)
+            output_file_name = "./{expected}.bmp".format(
+                expected=test_case.expected or "{input}_{name}".format(input=test_case.input, name=test_case.name))
             input_file = os.path.join("test_script", "data", input_file_name)
             expected_output_file = os.path.join("test_script", "data", output_file_name)
 
@@ -120,6 +258,217 @@ class ImageProcessorTester:
         except UnidentifiedImageError:
             self.fail_test_case(test_case.input, test_case.name, "output file is corrupt")
 
+    def check_output(self, input, name, expected, output_file_name, eps=0.0):
+        expected_output_file = os.path.join("test_script", "data", "{expected}.bmp".format(expected=expected))
+        try:
+            images_distance = calc_images_distance(expected_output_file, output_file_name)
+        except FileNotFoundError:
+            self.fail_test_case(input, name, "output file not found")
+        except UnidentifiedImageError:
+            self.fail_test_case(input, name, "output file is corrupt")
+        if images_distance > eps:
+            self.fail_test_case(input, name, "output image differs from expected with rms diff {diff}".format(
+                diff=images_distance))
+
+    def run(self, name, args):
+        try:
+            subprocess.check_call([self.image_processor_executable] + args, timeout=180)
+        except subprocess.CalledProcessError:
+            self.fail_test_case(name, "run", "image_processor finished with non-zero exit code")
+        except subprocess.TimeoutExpired:
+            self.fail_test_case(name, "run", "timeout")
+
+    def run_batch_tests(self):
+        inputs = {"flag": "flag_crop", "stripes": "stripes_crop"}
+        # mapped inputs are not read ahead, so they take another path
+        for name, settings in (("batch", []), ("batch_mmap", ["-mmap"])):
+            with tempfile.TemporaryDirectory() as directory:
+                input_dir = os.path.join(directory, "in")
+                output_dir = os.path.join(directory, "out")
+                os.mkdir(input_dir)
+                for input in inputs:
+                    shutil.copy(os.path.join("test_script", "data", input + ".bmp"), input_dir)
+                with open(os.path.join("test_script", "data", "flag.bmp"), "rb") as input_file:
+                    broken = input_file.read()[:100]
+                with open(os.path.join(input_dir, "broken.bmp"), "wb") as broken_file:
+                    broken_file.write(broken)
+
+                # a failed image is reported by the exit code and does not stop the others
+                if subprocess.call([self.image_processor_executable, input_dir, output_dir, "-batch", "-jobs", "2",
+                                    "-crop", "30", "150"] + settings, timeout=180) == 0:
+                    self.fail_test_case(name, "broken", "broken input was not reported")
+                if os.path.exists(os.path.join(output_dir, "broken.bmp")):
+                    self.fail_test_case(name, "broken", "output of a broken input was left")
+                for input, expected in inputs.items():
+                    self.check_output(name, input, expected, os.path.join(output_dir, input + ".bmp"))
+                self.succeed_test_case(name, "crop")
+
+    def run_branch_tests(self):
+        stripes = os.path.join("test_script", "data", "stripes.bmp")
+        shared = ["-crop", "30", "150"]
+        branches = {"edge": ["-gs", "-edge", "0.1"], "blur": ["-blur", "2"], "sharp": ["-sharp"]}
+        with tempfile.TemporaryDirectory() as directory:
+            args = [stripes, os.path.join(directory, "main.bmp")] + shared
+            for name, chain in branches.items():
+                args += ["-branch", os.path.join(directory, name + ".bmp")] + chain
+            self.run("branch", args)
+            self.check_output("branch", "main", "stripes_crop", os.path.join(directory, "main.bmp"))
+            self.succeed_test_case("branch", "main")
+
+            # the shared filters are exact in 8 bits, so a branch gives the same file as its whole chain
+            for name, chain in branches.items():
+                separate = os.path.join(directory, name + "_separate.bmp")
+                self.run("branch", [stripes, separate] + shared + chain)
+                try:
+                    with open(os.path.join(directory, name + ".bmp"), "rb") as branch_file, \
+                            open(separate, "rb") as separate_file:
+                        same = branch_file.read() == separate_file.read()
+                except FileNotFoundError:
+                    self.fail_test_case("branch", name, "output file not found")
+                if not same:
+                    self.fail_test_case("branch", name, "branch output differs from its chain run alone")
+                self.succeed_test_case("branch", name)
+
+    def run_cache_tests(self):
+        # input, chain, expected, eps, and the filters each run applies: the first run without the cache,
+        # the next ones with it
+        runs = [
+            ("stripes", ["-blur", "2", "-neg"], "stripes_blur_neg", 0.0, [["-blur", "-neg"], ["-blur", "-neg"], []]),
+            # resumes from the cached result of -blur 2
+            ("stripes", ["-blur", "2", "-gs"], "stripes_blur_gs", 0.0, [["-blur", "-gs"], ["-gs"], []]),
+            # the first cached run stores the pyramid, the second one also the result
+            ("grid", ["-preview", "60", "40", "-neg"], "grid_preview_neg", 0.0, [["-neg"], ["-neg"], []]),
+            # without the cache the level is halved in floats, the cached pyramid is rounded to 8 bits
+            ("grid", ["-preview", "60", "40", "-blur", "4"], "grid_preview_blur", 1.0, [["-blur"], ["-blur"], []]),
+        ]
+        with tempfile.TemporaryDirectory() as directory:
+            cache = os.path.join(directory, "cache")
+            profile = os.path.join(directory, "profile.json")
+            for input, chain, expected, eps, applied in runs:
+                name = expected[len(input) + 1:]
+                for k, filters in enumerate(applied):
+                    output_file_name = os.path.join(directory, "{name}_{k}.bmp".format(name=name, k=k))
+                    self.run("cache", [os.path.join("test_script", "data", input + ".bmp"), output_file_name] + chain +
+                             (["-cache", cache] if k > 0 else []) + ["-profile", profile])
+                    self.check_output(input, name, expected, output_file_name, eps)
+                    with open(profile) as profile_file:
+                        stages = [stage["name"] for stage in json.load(profile_file)["stages"]]
+                    if [stage for stage in stages if stage.startswith("-")] != filters:
+                        self.fail_test_case(input, name, "run {k} applied {stages}".format(k=k, stages=stages))
+                self.succeed_test_case(input, name)
+
+    @staticmethod
+    def read_response(connection):
+        response = b""
+        while not response.endswith(b"\n"):
+            chunk = connection.recv(1)
+            if not chunk:
+                break
+            response += chunk
+        return response.decode()
+
+    def run_server_tests(self):
+        flag = os.path.join("test_script", "data", "flag.bmp")
+        with tempfile.TemporaryDirectory() as directory:
+            socket_path = os.path.join(directory, "server.sock")
+            # one worker and one queued job, at most 8 open connections
+            server = subprocess.Popen([self.image_processor_executable, "-serve", socket_path, "-jobs", "1"])
+            connections = []
+
+            def connect():
+                connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                connection.settimeout(60)
+                connection.connect(socket_path)
+                connections.append(connection)
+                return connection
+
+            def request(connection, line):
+                connection.sendall(line.encode() + b"\n")
+                return self.read_response(connection)
+
+            try:
+                for _ in range(600):
+                    if os.path.exists(socket_path):
+                        break
+                    time.sleep(0.1)
+
+                # a connection past the limit is answered at once, before it sends anything
+                idle = [connect() for _ in range(8)]
+                if self.read_response(connect()) != "BUSY\n":
+                    self.fail_test_case("serve", "connections", "connection past the limit was accepted")
+                for connection in idle:
+                    connection.close()
+                self.succeed_test_case("serve", "connections")
+
+                # the idle connections are closed asynchronously, so the first job may still find them open
+                output_file_name = os.path.join(directory, "neg.bmp")
+                for _ in range(100):
+                    response = request(connect(), '"{input}" "{output}" -neg'.format(input=flag,
+                                                                                     output=output_file_name))
+                    if response != "BUSY\n":
+                        break
+                    time.sleep(0.1)
+                if not response.startswith("OK "):
+                    self.fail_test_case("serve", "neg", "unexpected response {response!r}".format(response=response))
+                self.check_output("serve", "neg", "flag_neg", output_file_name)
+                self.succeed_test_case("serve", "neg")
+
+                # inline input and output, and arguments with spaces
+                with open(flag, "rb") as input_file:
+                    data = input_file.read()
+                connection = connect()
+                connection.sendall('@{size} - -expr "1 - r" "g * 0.5" b\n'.format(size=len(data)).encode() + data)
+                response = self.read_response(connection).split()
+                if len(response) != 3 or response[0] != "OK":
+                    self.fail_test_case("serve", "expr", "unexpected response {response!r}".format(response=response))
+                output = b""
+                while len(output) < int(response[2]):
+                    output += connection.recv(int(response[2]) - len(output))
+                output_file_name = os.path.join(directory, "expr.bmp")
+                with open(output_file_name, "wb") as output_file:
+                    output_file.write(output)
+                self.check_output("serve", "expr", "flag_expr", output_file_name)
+                self.succeed_test_case("serve", "expr")
+
+                response = request(connection, "missing.bmp - -neg")
+                if not response.startswith("ERROR "):
+                    self.fail_test_case("serve", "error", "unexpected response {response!r}".format(response=response))
+                self.succeed_test_case("serve", "error")
+
+                # the only worker waits for a writer of the fifo, so of two more jobs one is queued and
+                # the other is turned away
+                fifo = os.path.join(directory, "input.fifo")
+                os.mkfifo(fifo)
+                holder = connect()
+                holder.sendall('"{input}" -\n'.format(input=fifo).encode())
+                for _ in range(600):
+                    try:
+                        writer = os.open(fifo, os.O_WRONLY | os.O_NONBLOCK)
+                        break
+                    except OSError:
+                        time.sleep(0.1)
+                waiting = [connect() for _ in range(2)]
+                for k, connection in enumerate(waiting):
+                    connection.sendall('"{input}" "{output}" -neg\n'.format(
+                        input=flag, output=os.path.join(directory, "queued{k}.bmp".format(k=k))).encode())
+                ready, _, _ = select.select(waiting, [], [], 60)
+                if len(ready) != 1 or self.read_response(ready[0]) != "BUSY\n":
+                    self.fail_test_case("serve", "busy", "a job past the queue was not turned away")
+                os.close(writer)
+                if not self.read_response(holder).startswith("ERROR "):
+                    self.fail_test_case("serve", "busy", "job with an empty input did not fail")
+                queued = waiting[1] if ready[0] is waiting[0] else waiting[0]
+                if not self.read_response(queued).startswith("OK "):
+                    self.fail_test_case("serve", "busy", "queued job did not run")
+                self.succeed_test_case("serve", "busy")
+            except OSError as e:
+                self.fail_test_case("serve", "socket", str(e))
+            finally:
+                for connection in connections:
+                    connection.close()
+                server.terminate()
+                server.wait()
+
 
 if __name__ == "__main__":
     tester = ImageProcessorTester(image_processor_executable=sys.argv[1])